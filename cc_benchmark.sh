@@ -0,0 +1,59 @@
+#!/bin/sh
+# Runs echo_sim over the congestion control matrix: every link profile,
+# workload, congestion control algorithm and HyStart/pacing setting. Each
+# run appends one line of JSON to the output file (see quiche_echo_sim.cc).
+#
+# usage: cc_benchmark.sh <echo_sim> <output.jsonl>
+# DURATION (seconds per run, default 10), SMP (shards, default 1) and SEED
+# (network seed, default 1) may be set in the environment. Every run uses
+# the same seed, so all settings face the same loss and jitter per packet.
+
+set -e
+
+SIM=$1
+OUT=$2
+DURATION=${DURATION:-10}
+SMP=${SMP:-1}
+SEED=${SEED:-1}
+
+if [ -z "$SIM" ] || [ -z "$OUT" ]; then
+    echo "usage: $0 <echo_sim> <output.jsonl>" >&2
+    exit 1
+fi
+
+# name: echo_sim link options
+PROFILES="
+lan:--delay 0.5 --bandwidth 1000
+broadband:--delay 15 --bandwidth 50 --queue 262144
+transcontinental:--delay 75 --bandwidth 100 --queue 1048576 --loss 0.1
+wifi:--delay 5 --jitter 5 --bandwidth 30 --loss 1 --loss-burst 3
+cellular:--delay 40 --jitter 20 --bandwidth 10 --queue 131072 --loss 2 --loss-burst 4 --reorder 1
+"
+
+# name: echo_sim load options
+WORKLOADS="
+bulk:--connections 1 --streams 1 --payload-size 4000000
+request-response:--connections 16 --streams 2 --payload-size 64-4096
+"
+
+: > "$OUT"
+
+echo "$PROFILES" | while IFS=: read -r profile link; do
+    [ -n "$profile" ] || continue
+    echo "$WORKLOADS" | while IFS=: read -r workload load; do
+        [ -n "$workload" ] || continue
+        for cc in reno cubic bbr; do
+            for hystart in true false; do
+                for pacing in true false; do
+                    echo "$profile / $workload: cc=$cc hystart=$hystart pacing=$pacing" >&2
+                    # shellcheck disable=SC2086
+                    "$SIM" --smp "$SMP" $link $load --duration "$DURATION" --seed "$SEED" \
+                        --cc "$cc" --hystart "$hystart" --pacing "$pacing" \
+                        --profile "$profile" --workload "$workload" --output "$OUT" < /dev/null > /dev/null
+                done
+            done
+        done
+    done
+done
+
+echo "results in $OUT" >&2
@@ -0,0 +1,105 @@
+#ifndef SEASTAR_QUICHE_BUFFER_POOL_H
+#define SEASTAR_QUICHE_BUFFER_POOL_H
+
+#include <seastar/core/deleter.hh>
+#include <seastar/core/temporary_buffer.hh>
+#include <stddef.h>
+#include <new>
+#include <vector>
+
+// Smallest chunk handed out; chunks come in powers of two from here up.
+#define BUFFER_POOL_MIN_SHIFT 11
+
+// Chunks handed out as temporary_buffers, which give the chunk back to the
+// pool once they (and every buffer shared from them) are gone. Outgoing
+// packets are written into a chunk and sent as slices of it, so a steady
+// send rate cycles through the same few chunks instead of allocating a
+// buffer per burst. Chunk sizes are powers of two, so at most half of a
+// chunk is wasted. Idle chunks are kept up to a byte limit, the rest is
+// returned to the allocator. One instance per shard; it has to outlive the
+// buffers it hands out.
+class buffer_pool {
+    // Idle chunks per size class, class i holds chunks of
+    // 2^(BUFFER_POOL_MIN_SHIFT + i) bytes.
+    std::vector<std::vector<char *>> _free;
+    size_t _free_bytes = 0;
+    size_t _max_free_bytes;
+    size_t _allocated_bytes = 0;
+
+    static size_t class_size(size_t cls) {
+        return (size_t) 1 << (BUFFER_POOL_MIN_SHIFT + cls);
+    }
+
+    void put(size_t cls, char *chunk) {
+        if (_free_bytes + class_size(cls) <= _max_free_bytes) {
+            _free[cls].push_back(chunk);
+            _free_bytes += class_size(cls);
+            return;
+        }
+
+        delete[] chunk;
+        _allocated_bytes -= class_size(cls);
+    }
+
+public:
+    // Serves requests of up to `max_size` bytes.
+    buffer_pool(size_t max_size, size_t max_free_bytes)
+            : _max_free_bytes(max_free_bytes) {
+        size_t classes = 1;
+        while (class_size(classes - 1) < max_size) {
+            classes++;
+        }
+        _free.resize(classes);
+    }
+
+    // Chunks handed out point back here.
+    buffer_pool(const buffer_pool &) = delete;
+    buffer_pool &operator=(const buffer_pool &) = delete;
+
+    ~buffer_pool() {
+        for (auto &chunks : _free) {
+            for (char *chunk : chunks) {
+                delete[] chunk;
+            }
+        }
+    }
+
+    void set_max_free_bytes(size_t bytes) {
+        _max_free_bytes = bytes;
+    }
+
+    // A buffer of `size` bytes; empty if `size` is above the pool's maximum
+    // or no memory is left.
+    seastar::temporary_buffer<char> get(size_t size) {
+        size_t cls = 0;
+        while (cls < _free.size() && class_size(cls) < size) {
+            cls++;
+        }
+        if (cls == _free.size()) {
+            return seastar::temporary_buffer<char>();
+        }
+
+        char *chunk;
+        if (!_free[cls].empty()) {
+            chunk = _free[cls].back();
+            _free[cls].pop_back();
+            _free_bytes -= class_size(cls);
+        } else {
+            chunk = new (std::nothrow) char[class_size(cls)];
+            if (chunk == NULL) {
+                return seastar::temporary_buffer<char>();
+            }
+            _allocated_bytes += class_size(cls);
+        }
+
+        return seastar::temporary_buffer<char>(chunk, size,
+                                               seastar::make_deleter([this, cls, chunk] { put(cls, chunk); }));
+    }
+
+    // Bytes of chunks in use or idle.
+    size_t allocated_bytes() const {
+        return _allocated_bytes;
+    }
+};
+
+#endif //SEASTAR_QUICHE_BUFFER_POOL_H
@@ -0,0 +1,175 @@
+#ifndef SEASTAR_QUICHE_CONN_TABLE_H
+#define SEASTAR_QUICHE_CONN_TABLE_H
+
+#include "quiche_utils.h"
+#include <openssl/siphash.h>
+#include <stdint.h>
+#include <string.h>
+#include <memory>
+
+// Maps the connection IDs of one shard to their connections.
+//
+// Open addressing with linear probing over a power of two array that is kept
+// at most half full, keys are stored inline. Erasing shifts the rest of the
+// probe run back instead of leaving tombstones, so lookups stay short no
+// matter how much connection churn the table has seen.
+class conn_table {
+    struct slot {
+        uint8_t cid[LOCAL_CONN_ID_LEN];
+        // NULL marks an empty slot.
+        struct conn_io *conn;
+    };
+
+    std::unique_ptr<slot[]> _slots;
+    size_t _mask;
+    size_t _size = 0;
+
+    static uint64_t load64(const uint8_t *p) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    // Locally minted IDs are random apart from the shard prefix, a cheap mix
+    // of both halves is enough to spread them.
+    size_t home(const uint8_t *cid) const {
+        uint64_t h = load64(cid) * 0x9e3779b97f4a7c15ULL;
+        h ^= load64(cid + 8) * 0xc2b2ae3d27d4eb4fULL;
+        return (size_t) (h ^ (h >> 29)) & _mask;
+    }
+
+    static bool same(const uint8_t *a, const uint8_t *b) {
+        return load64(a) == load64(b) && load64(a + 8) == load64(b + 8);
+    }
+
+    void grow() {
+        std::unique_ptr<slot[]> old = std::move(_slots);
+        size_t old_capacity = _mask + 1;
+
+        _mask = old_capacity * 2 - 1;
+        _slots.reset(new slot[_mask + 1]());
+
+        for (size_t i = 0; i < old_capacity; i++) {
+            if (old[i].conn != NULL) {
+                size_t pos = home(old[i].cid);
+                while (_slots[pos].conn != NULL) {
+                    pos = (pos + 1) & _mask;
+                }
+                _slots[pos] = old[i];
+            }
+        }
+    }
+
+public:
+    static_assert(LOCAL_CONN_ID_LEN == 16, "conn_table hashes 16 byte connection IDs");
+
+    // `capacity` must be a power of two.
+    explicit conn_table(size_t capacity = 1024)
+            : _slots(new slot[capacity]()), _mask(capacity - 1) {
+    }
+
+    size_t size() const {
+        return _size;
+    }
+
+    // Returns the connection owning `cid`, or NULL.
+    struct conn_io *find(const uint8_t *cid) const {
+        for (size_t pos = home(cid);; pos = (pos + 1) & _mask) {
+            const slot &s = _slots[pos];
+            if (s.conn == NULL) {
+                return NULL;
+            }
+            if (same(s.cid, cid)) {
+                return s.conn;
+            }
+        }
+    }
+
+    // Maps `cid` to `conn`, replacing any previous mapping.
+    void insert(const uint8_t *cid, struct conn_io *conn) {
+        if ((_size + 1) * 2 > _mask + 1) {
+            grow();
+        }
+
+        size_t pos = home(cid);
+        while (_slots[pos].conn != NULL) {
+            if (same(_slots[pos].cid, cid)) {
+                _slots[pos].conn = conn;
+                return;
+            }
+            pos = (pos + 1) & _mask;
+        }
+
+        memcpy(_slots[pos].cid, cid, LOCAL_CONN_ID_LEN);
+        _slots[pos].conn = conn;
+        _size++;
+    }
+
+    // Removes `cid`, returns whether it was present.
+    bool erase(const uint8_t *cid) {
+        size_t hole = home(cid);
+        while (true) {
+            if (_slots[hole].conn == NULL) {
+                return false;
+            }
+            if (same(_slots[hole].cid, cid)) {
+                break;
+            }
+            hole = (hole + 1) & _mask;
+        }
+
+        // Move back every following entry whose home is not between the hole
+        // and its current position, so that no probe run is broken.
+        for (size_t pos = (hole + 1) & _mask; _slots[pos].conn != NULL; pos = (pos + 1) & _mask) {
+            size_t h = home(_slots[pos].cid);
+            if (((pos - h) & _mask) >= ((pos - hole) & _mask)) {
+                _slots[hole] = _slots[pos];
+                hole = pos;
+            }
+        }
+
+        _slots[hole].conn = NULL;
+        _size--;
+        return true;
+    }
+
+    template <typename Func>
+    void for_each(Func &&func) const {
+        for (size_t i = 0; i <= _mask; i++) {
+            if (_slots[i].conn != NULL) {
+                func(_slots[i].cid, _slots[i].conn);
+            }
+        }
+    }
+};
+
+// Connection ID of the client's choosing (up to QUICHE_MAX_CONN_ID_LEN
+// bytes), stored inline so a lookup builds its key without allocating.
+struct odcid_key {
+    uint8_t len = 0;
+    uint8_t id[QUICHE_MAX_CONN_ID_LEN] = {};
+
+    odcid_key(const uint8_t *cid, size_t cid_len) : len((uint8_t) cid_len) {
+        memcpy(id, cid, cid_len);
+    }
+
+    bool operator==(const odcid_key &other) const {
+        return len == other.len && memcmp(id, other.id, len) == 0;
+    }
+};
+
+// SipHash under a random key of the shard: the peer picks these IDs and
+// must not be able to pile them into one bucket.
+struct odcid_hash {
+    uint64_t key[2] = {};
+
+    odcid_hash() {
+        shard_random.fill(reinterpret_cast<uint8_t *>(key), sizeof(key));
+    }
+
+    size_t operator()(const odcid_key &k) const {
+        return (size_t) SIPHASH_24(key, k.id, k.len);
+    }
+};
+
+#endif //SEASTAR_QUICHE_CONN_TABLE_H
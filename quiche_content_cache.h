@@ -0,0 +1,76 @@
+#ifndef SEASTAR_QUICHE_CONTENT_CACHE_H
+#define SEASTAR_QUICHE_CONTENT_CACHE_H
+
+#include <stdint.h>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// A response body kept in memory, with its content-length value formatted
+// once so serving it is a lookup and a write.
+struct cached_content {
+    std::vector<uint8_t> body;
+    std::string length;
+};
+
+// The files below a directory, keyed by request path ("/" followed by the
+// path relative to the directory). Loaded once at startup, copied to each
+// shard and never modified afterwards, so response bodies are sent straight
+// out of it.
+class content_cache {
+    std::unordered_map<std::string, cached_content> _entries;
+    size_t _bytes = 0;
+
+public:
+    // Reads every regular file below `dir`; false if any of them can't be
+    // read.
+    bool load(const std::string &dir) {
+        std::error_code ec;
+        std::filesystem::recursive_directory_iterator it(dir, ec);
+        if (ec) {
+            return false;
+        }
+
+        for (const auto &file : it) {
+            if (!file.is_regular_file()) {
+                continue;
+            }
+
+            std::ifstream in(file.path(), std::ios::binary);
+            if (!in) {
+                return false;
+            }
+
+            cached_content entry;
+            entry.body.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+            if (in.bad()) {
+                return false;
+            }
+            entry.length = std::to_string(entry.body.size());
+
+            _bytes += entry.body.size();
+            _entries["/" + file.path().lexically_relative(dir).generic_string()] = std::move(entry);
+        }
+
+        return true;
+    }
+
+    // NULL if nothing is cached under `path`.
+    const cached_content *find(const std::string &path) const {
+        auto it = _entries.find(path);
+        return it == _entries.end() ? NULL : &it->second;
+    }
+
+    size_t size() const {
+        return _entries.size();
+    }
+
+    size_t bytes() const {
+        return _bytes;
+    }
+};
+
+#endif //SEASTAR_QUICHE_CONTENT_CACHE_H
@@ -0,0 +1,78 @@
+#ifndef SEASTAR_QUICHE_DGRAM_H
+#define SEASTAR_QUICHE_DGRAM_H
+
+#include "quiche.h"
+#include <stdint.h>
+#include <string.h>
+#include <chrono>
+
+// Bound of quiche's DATAGRAM send and receive queues, in datagrams.
+#define DGRAM_QUEUE_LEN 1024
+
+// Latency probe the load client sends in DATAGRAM mode; the payload beyond
+// it is padding. Fields are in host byte order, client and server are
+// expected to share an architecture.
+struct dgram_probe {
+    uint64_t magic;
+    uint64_t seq;
+    // CLOCK_REALTIME when the client sent the probe.
+    uint64_t client_ns;
+    // CLOCK_REALTIME when the server echoed it.
+    uint64_t server_ns;
+};
+
+#define DGRAM_PROBE_MAGIC 0x71646772616d7072ULL
+
+static inline uint64_t realtime_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// Stamps the echo time into a probe, leaves any other datagram alone.
+static inline void dgram_stamp_echo(uint8_t *buf, size_t len) {
+    dgram_probe probe;
+    if (len < sizeof(probe)) {
+        return;
+    }
+
+    memcpy(&probe, buf, sizeof(probe));
+    if (probe.magic != DGRAM_PROBE_MAGIC) {
+        return;
+    }
+
+    probe.server_ns = realtime_ns();
+    memcpy(buf, &probe, sizeof(probe));
+}
+
+// quiche's purge callback carries no context, so the number of entries
+// still to drop is passed on the side.
+static thread_local size_t dgram_purge_left = 0;
+
+static bool dgram_purge_next(uint8_t *, size_t) {
+    if (dgram_purge_left == 0) {
+        return false;
+    }
+
+    dgram_purge_left--;
+    return true;
+}
+
+// Drops the oldest queued outgoing datagrams until `want` more fit into
+// DGRAM_QUEUE_LEN: under pressure fresh datagrams are worth more than
+// stale ones. Returns how many were dropped.
+static inline size_t dgram_make_room(quiche_conn *conn, size_t want) {
+    ssize_t queued = quiche_conn_dgram_send_queue_len(conn);
+    if (queued < 0 || (size_t) queued + want <= DGRAM_QUEUE_LEN) {
+        return 0;
+    }
+
+    size_t excess = queued + want - DGRAM_QUEUE_LEN;
+    dgram_purge_left = excess;
+    quiche_conn_dgram_purge_outgoing(conn, dgram_purge_next);
+
+    size_t dropped = excess - dgram_purge_left;
+    dgram_purge_left = 0;
+    return dropped;
+}
+
+#endif //SEASTAR_QUICHE_DGRAM_H
@@ -10,6 +10,12 @@
 
 #include "quiche.h"
 #include "quiche_utils.h"
+#include "quiche_histogram.h"
+#include "quiche_log.h"
+#include "quiche_dgram.h"
+#include "quiche_load.h"
+#include "quiche_sim_net.h"
+#include "quiche_embed.h"
 
 #include <seastar/core/seastar.hh>
 #include <seastar/core/sleep.hh>
@@ -23,20 +29,29 @@
 #include <seastar/core/reactor.hh>
 #include <seastar/util/log.hh>
 #include <seastar/core/iostream.hh>
+#include <seastar/core/timer.hh>
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <memory>
+#include <random>
+#include <unordered_map>
 
 #define LOCAL_CONN_ID_LEN 16
 
 #define MAX_DATAGRAM_SIZE 1350
 
-const char *host = "127.0.0.1";
-uint16_t port = 1234;
+static const char *host = "127.0.0.1";
+static uint16_t port = 1234;
 
-seastar::future<> x = seastar::make_ready_future<>();
+static seastar::future<> x = seastar::make_ready_future<>();
 
 using namespace seastar::net;
 
+static seastar::logger client_log("echo_client");
 
-seastar::future<> send_data(struct conn_io &conn_data, udp_channel &chan, seastar::ipv4_addr &addr) {
+
+static seastar::future<> send_data(struct conn_io &conn_data, udp_channel &chan, seastar::ipv4_addr &addr) {
     uint8_t out[MAX_DATAGRAM_SIZE];
 
     quiche_send_info send_info;
@@ -68,7 +83,7 @@ seastar::future<> send_data(struct conn_io &conn_data, udp_channel &chan, seasta
 static bool echo_received = true;
 
 
-seastar::future<>
+static seastar::future<>
 handle_connection(uint8_t *buf, ssize_t read, struct conn_io *conn_io, udp_channel &channel, udp_datagram &datagram,
                   seastar::ipv4_addr &addr) {
 
@@ -163,7 +178,7 @@ handle_connection(uint8_t *buf, ssize_t read, struct conn_io *conn_io, udp_chann
     return send_data(*conn_io, channel, addr);
 }
 
-seastar::future<> receive(struct conn_io &conn_io, udp_channel &channel, seastar::ipv4_addr &addr) {
+static seastar::future<> receive(struct conn_io &conn_io, udp_channel &channel, seastar::ipv4_addr &addr) {
     return channel.receive().then([&conn_io, &channel, &addr](udp_datagram datagram) {
 
         uint8_t buffer[MAX_DATAGRAM_SIZE];
@@ -175,14 +190,16 @@ seastar::future<> receive(struct conn_io &conn_io, udp_channel &channel, seastar
     });
 }
 
-seastar::future<> client_loop() {
-
-    std::cout << "starting client loop" << std::endl;
+// The interactive client starts with a grease version to exercise version
+// negotiation; the load generator uses the real one so no connection pays
+// for a Version Negotiation round trip.
+#define GREASE_VERSION 0xbabababa
 
-    quiche_config *config = quiche_config_new(0xbabababa);
+static quiche_config *client_config(uint32_t version) {
+    quiche_config *config = quiche_config_new(version);
     if (config == nullptr) {
         fprintf(stderr, "failed to create config\n");
-        return seastar::make_ready_future<>();
+        return nullptr;
     }
 
     quiche_config_set_application_protos(config,
@@ -202,28 +219,25 @@ seastar::future<> client_loop() {
         quiche_config_log_keys(config);
     }
 
-    uint8_t scid[LOCAL_CONN_ID_LEN];
-    int rng = open("/dev/urandom", O_RDONLY);
-    if (rng < 0) {
-        perror("failed to open /dev/urandom");
-        return seastar::make_ready_future<>();
-    }
+    return config;
+}
 
-    ssize_t rand_len = read(rng, &scid, sizeof(scid));
-    if (rand_len < 0) {
-        perror("failed to create connection ID");
+static seastar::future<> client_loop() {
+
+    std::cout << "starting client loop" << std::endl;
+
+    quiche_config *config = client_config(GREASE_VERSION);
+    if (config == nullptr) {
         return seastar::make_ready_future<>();
     }
 
-    struct conn_io *conn_data = nullptr;
-    conn_data = (conn_io *) calloc(1, sizeof(conn_io));
-
-    if (conn_data == nullptr) {
-        fprintf(stderr, "failed to allocate connection IO\n");
+    uint8_t scid[LOCAL_CONN_ID_LEN];
+    if (!shard_random.fill(scid, sizeof(scid))) {
+        perror("failed to create connection ID");
         return seastar::make_ready_future<>();
     }
 
-    return seastar::do_with(seastar::make_udp_channel(), seastar::ipv4_addr(host, port),
+    return seastar::do_with(make_quic_channel(), seastar::ipv4_addr(host, port),
                             [&config, &scid](udp_channel &channel, seastar::ipv4_addr &addr) {
                                 std::cout << "starting do_with" << std::endl;
                                 sockaddr local_addr = channel.local_address().as_posix_sockaddr();
@@ -234,11 +248,7 @@ seastar::future<> client_loop() {
                                 sockaddr peer_addr = dest.as_posix_sockaddr();
                                 socklen_t peer_addr_len = sizeof(peer_addr);
 
-                                struct conn_io *conn_data = nullptr;
-                                conn_data = (conn_io *) calloc(1, sizeof(conn_io));
-                                if (conn_data == nullptr) {
-                                    fprintf(stderr, "failed to allocate connection IO\n");
-                                }
+                                struct conn_io *conn_data = new conn_io();
 
                                 quiche_conn *conn = quiche_connect(host, (const uint8_t *) scid, sizeof(scid),
                                                                    (struct sockaddr *) &local_addr,
@@ -255,7 +265,7 @@ seastar::future<> client_loop() {
 
                                 using namespace std::chrono_literals;
                                 return send_data(*conn_data, channel, addr)
-                                        .then([&conn_data, &channel, &dest, &addr]() {
+                                        .then([conn_data, &channel, &addr]() {
 
                                             return seastar::do_with(conn_data, addr,
                                                                     [&channel](auto &conn_data, auto &addr) {
@@ -270,21 +280,679 @@ seastar::future<> client_loop() {
                             });
 }
 
-seastar::future<> f() {
+// Load generation, used instead of the interactive mode when --connections
+// is given.
+//
+// Every shard opens --connections connections, each on its own UDP socket.
+// A request is one bidirectional stream: the payload goes out with FIN and
+// the request completes when the echoed stream finishes. Closed loop keeps
+// --streams requests outstanding per connection. With --rate, each shard
+// starts requests on a fixed schedule instead (open loop) and latency is
+// measured from the scheduled start, so time spent queued behind a slow
+// server is not hidden.
+//
+// With --dgram a request is a DATAGRAM frame carrying a dgram_probe instead
+// of a stream. Besides the round trip, the client reports both one-way
+// delays from the realtime stamps of client and server, which only mean
+// something when their clocks are synchronized. A probe not echoed within
+// DGRAM_PROBE_TIMEOUT_NS counts as lost.
+//
+// With --requests-per-connection a connection is closed after that many
+// stream requests and a new one is opened on the same socket, so the
+// kernel hands its packets to the same server shard, the one holding the
+// ticket keys. Unless --resume is off, the new connection resumes the
+// previous session and its first requests go out as 0-RTT early data.
+
+#define DGRAM_PROBE_TIMEOUT_NS 1000000000ULL
+
+// Set from the command line (or by echo_load_run) before the shards start.
+static load_options load_opts;
+
+static uint64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            seastar::steady_clock_type::now().time_since_epoch()).count();
+}
+
+class load_connection {
+    struct request {
+        uint64_t start_ns;
+        size_t len;
+        size_t sent;
+    };
+
+    udp_channel _chan;
+    seastar::socket_address _server;
+    quiche_conn *_conn = nullptr;
+    const std::vector<uint8_t> &_payload;
+    load_result &_result;
+    std::mt19937_64 &_rng;
+    seastar::timer<seastar::steady_clock_type> _timeout;
+    std::unordered_map<uint64_t, request> _inflight;
+    // Scheduled start times of open loop requests waiting for a stream.
+    std::deque<uint64_t> _backlog;
+    uint64_t _next_stream = 0;
+    // DATAGRAM mode: start time of the probes awaiting their echo, by
+    // sequence number.
+    std::map<uint64_t, uint64_t> _probes;
+    uint64_t _next_probe = 0;
+    quiche_config *_config = nullptr;
+    // Session of the previous connection, offered when reconnecting.
+    std::vector<uint8_t> _session;
+    uint64_t _connect_ns = 0;
+    // The current connection sent early data under a resumed session.
+    // Whether the server took it isn't visible to the client.
+    bool _offered = false;
+    bool _first_echo = false;
+    unsigned _conn_completed = 0;
+    bool _reconnect_pending = false;
+    bool _established = false;
+    bool _stopping = false;
+    bool _input_shut = false;
+    seastar::future<> _done = seastar::make_ready_future<>();
+
+    void shut_input() {
+        if (!_input_shut) {
+            _input_shut = true;
+            _chan.shutdown_input();
+        }
+    }
+
+    void send_packets() {
+        uint8_t out[MAX_DATAGRAM_SIZE];
+        quiche_send_info send_info;
+
+        while (true) {
+            ssize_t written = quiche_conn_send(_conn, out, sizeof(out), &send_info);
+
+            if (written == QUICHE_ERR_DONE) {
+                break;
+            }
+
+            if (written < 0) {
+                QLOG_LIMITED(client_log, seastar::log_level::error, "failed to create packet: {}", written);
+                break;
+            }
+
+            (void) _chan.send(_server, seastar::temporary_buffer<char>(reinterpret_cast<const char *>(out), written));
+        }
+    }
+
+    void flush() {
+        if (_conn == nullptr) {
+            return;
+        }
+
+        send_packets();
+
+        if (quiche_conn_is_closed(_conn)) {
+            _timeout.cancel();
+            shut_input();
+            return;
+        }
+
+        uint64_t timeout = quiche_conn_timeout_as_nanos(_conn);
+        if (timeout == UINT64_MAX) {
+            _timeout.cancel();
+        } else {
+            _timeout.rearm(seastar::steady_clock_type::now() + std::chrono::nanoseconds(timeout));
+        }
+    }
+
+    void send_more(uint64_t stream_id, request &req) {
+        ssize_t written = quiche_conn_stream_send(_conn, stream_id, _payload.data() + req.sent,
+                                                  req.len - req.sent, true);
+        if (written > 0) {
+            req.sent += written;
+        }
+    }
+
+    size_t payload_len() {
+        size_t len = load_opts.payload_min;
+        if (load_opts.payload_max > load_opts.payload_min) {
+            len += _rng() % (load_opts.payload_max - load_opts.payload_min + 1);
+        }
+        return len;
+    }
+
+    void send_probe(uint64_t start_ns) {
+        static thread_local uint8_t buf[MAX_DATAGRAM_SIZE];
+
+        size_t len = std::max(payload_len(), sizeof(dgram_probe));
+        ssize_t max_len = quiche_conn_dgram_max_writable_len(_conn);
+        if (max_len < (ssize_t) sizeof(dgram_probe)) {
+            _result.dgrams_lost++;
+            return;
+        }
+        len = std::min(len, std::min((size_t) max_len, sizeof(buf)));
+
+        dgram_probe probe = {DGRAM_PROBE_MAGIC, _next_probe++, realtime_ns(), 0};
+        memcpy(buf, &probe, sizeof(probe));
+        memset(buf + sizeof(probe), 'x', len - sizeof(probe));
+
+        dgram_make_room(_conn, 1);
+        if (quiche_conn_dgram_send(_conn, buf, len) < 0) {
+            _result.dgrams_lost++;
+            return;
+        }
+
+        _probes[probe.seq] = start_ns;
+    }
+
+    void expire_probes(uint64_t now) {
+        while (!_probes.empty() && now - _probes.begin()->second > DGRAM_PROBE_TIMEOUT_NS) {
+            _result.dgrams_lost++;
+            _probes.erase(_probes.begin());
+        }
+    }
+
+    void read_datagrams() {
+        static thread_local uint8_t scratch[MAX_UDP_PAYLOAD];
+
+        while (true) {
+            ssize_t len = quiche_conn_dgram_recv(_conn, scratch, sizeof(scratch));
+            if (len < 0) {
+                break;
+            }
+
+            dgram_probe probe;
+            if ((size_t) len < sizeof(probe)) {
+                continue;
+            }
+            memcpy(&probe, scratch, sizeof(probe));
+
+            auto it = _probes.find(probe.seq);
+            if (probe.magic != DGRAM_PROBE_MAGIC || it == _probes.end()) {
+                continue;
+            }
+
+            uint64_t received_ns = realtime_ns();
+            _result.latency.record(now_ns() - it->second);
+            _result.one_way_up.record(probe.server_ns > probe.client_ns ? probe.server_ns - probe.client_ns : 0);
+            _result.one_way_down.record(received_ns > probe.server_ns ? received_ns - probe.server_ns : 0);
+            _result.completed++;
+            _result.bytes += len;
+            _probes.erase(it);
+        }
+    }
+
+    void issue(uint64_t start_ns) {
+        if (load_opts.dgram) {
+            send_probe(start_ns);
+            return;
+        }
+
+        size_t len = payload_len();
+
+        uint64_t stream_id = _next_stream;
+        _next_stream += 4;
+
+        request &req = _inflight[stream_id] = request{start_ns, len, 0};
+        send_more(stream_id, req);
+    }
+
+    // Starts whatever requests the mode allows and pushes pending payloads.
+    void pump() {
+        if (_stopping || _conn == nullptr ||
+            (!_established && !quiche_conn_is_in_early_data(_conn))) {
+            return;
+        }
+
+        if (load_opts.dgram) {
+            uint64_t now = now_ns();
+            expire_probes(now);
+
+            if (load_opts.rate == 0) {
+                while (_probes.size() < load_opts.streams) {
+                    size_t before = _probes.size();
+                    issue(now);
+                    if (_probes.size() == before) {
+                        break;
+                    }
+                }
+            } else {
+                while (!_backlog.empty()) {
+                    issue(_backlog.front());
+                    _backlog.pop_front();
+                }
+            }
+            return;
+        }
+
+        if (load_opts.rate == 0) {
+            uint64_t now = now_ns();
+            while (_inflight.size() < load_opts.streams && quiche_conn_peer_streams_left_bidi(_conn) > 0) {
+                issue(now);
+            }
+        } else {
+            while (!_backlog.empty() && quiche_conn_peer_streams_left_bidi(_conn) > 0) {
+                issue(_backlog.front());
+                _backlog.pop_front();
+            }
+        }
+
+        for (auto &[stream_id, req] : _inflight) {
+            if (req.sent < req.len) {
+                send_more(stream_id, req);
+            }
+        }
+    }
+
+    void complete(uint64_t stream_id) {
+        auto it = _inflight.find(stream_id);
+        if (it == _inflight.end()) {
+            return;
+        }
+
+        uint64_t now = now_ns();
+        _result.latency.record(now - it->second.start_ns);
+        _result.completed++;
+        _inflight.erase(it);
+
+        if (!_first_echo) {
+            _first_echo = true;
+            (_offered ? _result.first_echo_offered_0rtt : _result.first_echo_no_session).record(now - _connect_ns);
+        }
+
+        if (load_opts.requests_per_connection > 0 &&
+            ++_conn_completed >= load_opts.requests_per_connection) {
+            _reconnect_pending = true;
+        }
+    }
+
+    void read_streams() {
+        static thread_local uint8_t scratch[65536];
+
+        uint64_t s = 0;
+        quiche_stream_iter *readable = quiche_conn_readable(_conn);
+
+        while (quiche_stream_iter_next(readable, &s)) {
+            bool fin = false;
+
+            while (!fin) {
+                ssize_t recv_len = quiche_conn_stream_recv(_conn, s, scratch, sizeof(scratch), &fin);
+                if (recv_len <= 0) {
+                    break;
+                }
+                _result.bytes += recv_len;
+            }
+
+            if (fin) {
+                complete(s);
+            }
+        }
+
+        quiche_stream_iter_free(readable);
+    }
+
+    void on_datagram(udp_datagram &dgram) {
+        net::packet &p = dgram.get_data();
+        p.linearize();
+
+        sockaddr peer_addr = dgram.get_src().as_posix_sockaddr();
+        sockaddr local_addr = _chan.local_address().as_posix_sockaddr();
+        quiche_recv_info recv_info = {
+                &peer_addr,
+                sizeof(peer_addr),
+                &local_addr,
+                sizeof(local_addr),
+        };
+
+        ssize_t done = quiche_conn_recv(_conn, reinterpret_cast<uint8_t *>(p.frag(0).base), p.len(), &recv_info);
+        if (done < 0) {
+            QLOG_DEBUG(client_log, "failed to process packet: {}", done);
+        }
+
+        if (!_established && quiche_conn_is_established(_conn)) {
+            on_established();
+        }
+
+        if (_established) {
+            read_streams();
+            if (load_opts.dgram) {
+                read_datagrams();
+            }
+        }
+
+        if (_reconnect_pending && !_stopping) {
+            reconnect();
+            return;
+        }
+
+        pump();
+        flush();
+    }
+
+    void on_established() {
+        _established = true;
+        if (_offered) {
+            _result.handshakes_offered_0rtt++;
+        } else {
+            _result.handshakes_no_session++;
+        }
+    }
+
+    bool connect() {
+        uint8_t scid[LOCAL_CONN_ID_LEN];
+        if (gen_cid(scid, sizeof(scid), seastar::this_shard_id()) == NULL) {
+            return false;
+        }
+
+        sockaddr local_addr = _chan.local_address().as_posix_sockaddr();
+        sockaddr peer_addr = _server.as_posix_sockaddr();
+
+        _conn = quiche_connect(host, scid, sizeof(scid),
+                               &local_addr, sizeof(local_addr),
+                               &peer_addr, sizeof(peer_addr),
+                               _config);
+        if (_conn == nullptr) {
+            return false;
+        }
+
+        bool offered = !_session.empty() &&
+                       quiche_conn_set_session(_conn, _session.data(), _session.size()) == 0;
+
+        _connect_ns = now_ns();
+        _established = false;
+        _first_echo = false;
+        _conn_completed = 0;
+        _next_stream = 0;
+
+        // The ClientHello is written by the first flush; only then does
+        // quiche know whether the session allows early data.
+        flush();
+        _offered = offered && quiche_conn_is_in_early_data(_conn);
+        pump();
+        flush();
+        return true;
+    }
+
+    // Replaces the connection with a new one on the same socket, resuming
+    // the old one's session. The old connection is closed without waiting
+    // out its draining period; stray packets for it are rejected by the
+    // new one.
+    void reconnect() {
+        _reconnect_pending = false;
+
+        if (load_opts.resume) {
+            const uint8_t *session;
+            size_t session_len;
+            quiche_conn_session(_conn, &session, &session_len);
+            if (session_len > 0) {
+                _session.assign(session, session + session_len);
+            }
+        }
+
+        quiche_conn_close(_conn, true, 0, (const uint8_t *) "", 0);
+        send_packets();
+        _timeout.cancel();
+        quiche_conn_free(_conn);
+        _conn = nullptr;
+
+        _result.incomplete += _inflight.size();
+        _inflight.clear();
+
+        if (!connect()) {
+            _result.failed_connections++;
+            _stopping = true;
+            shut_input();
+        }
+    }
+
+    seastar::future<> receive_loop() {
+        return seastar::repeat([this] {
+            return _chan.receive().then([this](udp_datagram dgram) {
+                on_datagram(dgram);
+                return _conn == nullptr || quiche_conn_is_closed(_conn) ? seastar::stop_iteration::yes
+                                                                        : seastar::stop_iteration::no;
+            });
+        }).handle_exception([](std::exception_ptr) {
+            // Receiving is aborted by shutting the channel's input down.
+        });
+    }
+
+public:
+    load_connection(const seastar::socket_address &server, const std::vector<uint8_t> &payload,
+                    load_result &result, std::mt19937_64 &rng)
+            : _chan(make_quic_channel()), _server(server), _payload(payload),
+              _result(result), _rng(rng), _timeout([this] {
+                  quiche_conn_on_timeout(_conn);
+                  pump();
+                  flush();
+              }) {
+    }
+
+    load_connection(const load_connection &) = delete;
+
+    ~load_connection() {
+        if (_conn != nullptr) {
+            quiche_conn_free(_conn);
+        }
+    }
+
+    bool start(quiche_config *config) {
+        _config = config;
+        if (!connect()) {
+            return false;
+        }
+
+        _done = receive_loop();
+        return true;
+    }
+
+    // Queues an open loop request scheduled to start at `start_ns`.
+    void submit(uint64_t start_ns) {
+        _backlog.push_back(start_ns);
+        pump();
+        flush();
+    }
+
+    seastar::future<> stop() {
+        _stopping = true;
+        _result.incomplete += _inflight.size() + _backlog.size() + _probes.size();
+        if (_conn == nullptr) {
+            return std::move(_done);
+        }
+        if (!_established) {
+            _result.failed_connections++;
+        }
+
+        quiche_conn_close(_conn, true, 0, nullptr, 0);
+        flush();
+        shut_input();
+
+        return std::move(_done);
+    }
+};
+
+class load_generator {
+    quiche_config *_config = nullptr;
+    std::vector<uint8_t> _payload;
+    load_result _result;
+    std::mt19937_64 _rng;
+    std::vector<std::unique_ptr<load_connection>> _conns;
+    // Open loop: next scheduled request start and round robin position.
+    seastar::timer<seastar::steady_clock_type> _schedule;
+    double _next_ns = 0;
+    size_t _next_conn = 0;
+    uint64_t _start_ns = 0;
+
+    void start_scheduled() {
+        uint64_t now = now_ns();
+
+        while (_next_ns <= now) {
+            _conns[_next_conn++ % _conns.size()]->submit((uint64_t) _next_ns);
+            _next_ns += 1e9 / load_opts.rate;
+        }
+    }
+
+public:
+    load_generator()
+            : _rng(now_ns() ^ seastar::this_shard_id()), _schedule([this] { start_scheduled(); }) {
+    }
+
+    ~load_generator() {
+        _conns.clear();
+        if (_config != nullptr) {
+            quiche_config_free(_config);
+        }
+    }
+
+    seastar::future<load_result> run() {
+        _config = client_config(QUICHE_PROTOCOL_VERSION);
+        if (_config == nullptr) {
+            return seastar::make_ready_future<load_result>(std::move(_result));
+        }
+        quiche_config_enable_dgram(_config, load_opts.dgram, DGRAM_QUEUE_LEN, DGRAM_QUEUE_LEN);
+        if (load_opts.resume) {
+            quiche_config_enable_early_data(_config);
+        }
+
+        _payload.assign(load_opts.payload_max, 'x');
+
+        seastar::socket_address server(seastar::ipv4_addr(host, port));
+        for (unsigned i = 0; i < load_opts.connections; i++) {
+            auto conn = std::make_unique<load_connection>(server, _payload, _result, _rng);
+            if (!conn->start(_config)) {
+                _result.failed_connections++;
+                continue;
+            }
+            _conns.push_back(std::move(conn));
+        }
+
+        _start_ns = now_ns();
+        if (load_opts.rate > 0 && !_conns.empty()) {
+            _next_ns = _start_ns;
+            _schedule.arm_periodic(std::chrono::milliseconds(1));
+        }
+
+        return seastar::sleep(load_opts.duration).then([this] {
+            _schedule.cancel();
+            _result.seconds = (now_ns() - _start_ns) / 1e9;
+
+            return seastar::parallel_for_each(_conns, [](auto &conn) {
+                return conn->stop();
+            });
+        }).then([this] {
+            return std::move(_result);
+        });
+    }
+};
+
+static seastar::future<load_result> run_load() {
+    auto gen = std::make_unique<load_generator>();
+    auto done = gen->run();
+    return done.finally([gen = std::move(gen)] {});
+}
+
+static void print_load_result(const load_result &total) {
+    double seconds = total.seconds > 0 ? total.seconds : 1;
+
+    printf("%" PRIu64 " requests in %.2f s on %u shards (%" PRIu64 " incomplete, %" PRIu64 " failed connections)\n",
+           total.completed, total.seconds, seastar::smp::count, total.incomplete, total.failed_connections);
+    printf("throughput: %.0f req/s, %.2f MiB/s echoed\n",
+           total.completed / seconds, total.bytes / seconds / (1 << 20));
+    printf("latency (us): p50 %.1f  p99 %.1f  p999 %.1f  max %.1f\n",
+           total.latency.quantile(0.5) / 1e3, total.latency.quantile(0.99) / 1e3,
+           total.latency.quantile(0.999) / 1e3, total.latency.max() / 1e3);
+
+    if (load_opts.requests_per_connection > 0) {
+        printf("handshakes: %" PRIu64 " without a session, %" PRIu64 " offered 0-RTT\n",
+               total.handshakes_no_session, total.handshakes_offered_0rtt);
+        printf("  (offered is not resumed: the server's quic_early_data_accepted counts the 0-RTT it took)\n");
+        printf("first echo, no session (us): p50 %.1f  p99 %.1f  max %.1f\n",
+               total.first_echo_no_session.quantile(0.5) / 1e3, total.first_echo_no_session.quantile(0.99) / 1e3,
+               total.first_echo_no_session.max() / 1e3);
+        printf("first echo, 0-RTT offered, resumed or not (us): p50 %.1f  p99 %.1f  max %.1f\n",
+               total.first_echo_offered_0rtt.quantile(0.5) / 1e3, total.first_echo_offered_0rtt.quantile(0.99) / 1e3,
+               total.first_echo_offered_0rtt.max() / 1e3);
+    }
+
+    if (load_opts.dgram) {
+        uint64_t sent = total.completed + total.dgrams_lost;
+        printf("datagrams: %" PRIu64 " lost (%.2f%%)\n",
+               total.dgrams_lost, sent ? 100.0 * total.dgrams_lost / sent : 0);
+        printf("one-way up (us): p50 %.1f  p99 %.1f  max %.1f\n",
+               total.one_way_up.quantile(0.5) / 1e3, total.one_way_up.quantile(0.99) / 1e3,
+               total.one_way_up.max() / 1e3);
+        printf("one-way down (us): p50 %.1f  p99 %.1f  max %.1f\n",
+               total.one_way_down.quantile(0.5) / 1e3, total.one_way_down.quantile(0.99) / 1e3,
+               total.one_way_down.max() / 1e3);
+    }
+}
+
+static seastar::future<load_result> run_load_test() {
+    auto cores = boost::irange<unsigned>(0, seastar::smp::count);
+
+    return seastar::map_reduce(cores.begin(), cores.end(),
+                               [](unsigned core) {
+                                   return seastar::smp::submit_to(core, run_load);
+                               },
+                               load_result(),
+                               [](load_result total, load_result shard) {
+                                   return std::move(total.merge(shard));
+                               }).then([](load_result total) {
+        print_load_result(total);
+        return total;
+    });
+}
+
+static seastar::future<> f() {
     return seastar::parallel_for_each(boost::irange<unsigned>(0, seastar::smp::count),
                                       [](unsigned core) {
                                           return seastar::smp::submit_to(core, client_loop);
                                       });
 }
 
+seastar::future<load_result> echo_load_run(const load_options &opts) {
+    load_opts = opts;
+    return run_load_test();
+}
+
+#ifndef QUICHE_ECHO_EMBEDDED
 int main(int argc, char **argv) {
     seastar::app_template app;
 
     namespace po = boost::program_options;
 
+    app.add_options()
+            ("connections", po::value<unsigned>()->default_value(0),
+             "connections per shard; non-zero runs a load test instead of the interactive client")
+            ("streams", po::value<unsigned>()->default_value(1),
+             "concurrent requests per connection (closed loop)")
+            ("payload-size", po::value<std::string>()->default_value("1024"),
+             "request payload size in bytes, N or MIN-MAX for a uniform distribution")
+            ("rate", po::value<double>()->default_value(0),
+             "requests per second per shard (open loop), 0 for closed loop")
+            ("duration", po::value<unsigned>()->default_value(10),
+             "load test duration in seconds")
+            ("dgram", po::value<bool>()->default_value(false),
+             "send requests as DATAGRAM frames instead of streams (needs a server started with --dgram)")
+            ("requests-per-connection", po::value<unsigned>()->default_value(0),
+             "reconnect after this many requests, 0 to keep connections open")
+            ("resume", po::value<bool>()->default_value(true),
+             "resume the previous session with 0-RTT when reconnecting");
+
     try {
         app.run(argc, argv, [&]() {
             auto &&config = app.configuration();
+
+            load_opts.connections = config["connections"].as<unsigned>();
+            load_opts.streams = std::max(config["streams"].as<unsigned>(), 1u);
+            load_opts.rate = config["rate"].as<double>();
+            load_opts.duration = std::chrono::seconds(config["duration"].as<unsigned>());
+            load_opts.dgram = config["dgram"].as<bool>();
+            load_opts.requests_per_connection = config["requests-per-connection"].as<unsigned>();
+            load_opts.resume = config["resume"].as<bool>();
+            if (!parse_payload_size(config["payload-size"].as<std::string>(),
+                                    load_opts.payload_min, load_opts.payload_max)) {
+                std::cerr << "invalid --payload-size\n";
+                return seastar::make_ready_future<>();
+            }
+
+            if (load_opts.connections > 0) {
+                return run_load_test().discard_result();
+            }
+
             return f();
         });
     } catch (...) {
@@ -293,3 +961,4 @@ int main(int argc, char **argv) {
     }
     return 0;
 }
+#endif
@@ -5,27 +5,467 @@
 #include <seastar/core/reactor.hh>
 #include <seastar/core/distributed.hh>
 #include <seastar/core/sleep.hh>
+#include <seastar/core/timer.hh>
+#include <seastar/core/later.hh>
+#include <seastar/core/lowres_clock.hh>
+#include <seastar/core/metrics.hh>
+#include <seastar/core/prometheus.hh>
+#include <seastar/http/httpd.hh>
 #include "seastar/net/api.hh"
 #include "quiche.h"
 #include "quiche_utils.h"
+#include "quiche_conn_table.h"
+#include "quiche_timer_wheel.h"
+#include "quiche_pacer.h"
+#include "quiche_egress.h"
+#include "quiche_udp_socket.h"
+#include "quiche_buffer_pool.h"
+#include "quiche_sim_net.h"
+#include "quiche_embed.h"
+#include "quiche_log.h"
+#include "quiche_token.h"
+#include "quiche_slab_pool.h"
+#include "quiche_send_queue.h"
+#include "quiche_content_cache.h"
+#include "quiche_dgram.h"
+#include "quiche_stage_timer.h"
 #include <inttypes.h>
+#include <stddef.h>
+#include <signal.h>
+#include <sys/random.h>
+#include <algorithm>
+#include <string>
+#include <string_view>
+#include <unordered_map>
 
 using namespace seastar;
 using namespace net;
 using namespace std::chrono_literals;
 
-extern seastar::future<> f();
+namespace sm = seastar::metrics;
+
+static seastar::logger server_log("echo_server");
+
+static seastar::future<> f();
+
+static seastar::future<> start_quiche_server();
+
+static void handle_connection(uint8_t *buf, ssize_t read, udp_channel &chan,
+                              const socket_address &src, const socket_address &dst);
+
+// Set from the command line before the shards start, read-only afterwards.
+static transport_settings settings;
+static uint16_t prometheus_port = 9180;
+
+static bool http3_enabled = false;
+static bool dgram_enabled = false;
+// Serve from a socket of our own that sends bursts with UDP GSO instead of
+// seastar's UDP channel.
+static bool gso_enabled = true;
+// Most messages taken per recvmmsg() on the server's own socket, or
+// datagrams processed per wakeup of seastar's channel.
+static unsigned ingress_batch = 32;
+static std::string content_dir;
+// Whether the shards time the stages of the packet path. Set from the
+// command line, toggled by SIGUSR2 on shard 0 afterwards.
+static bool stage_timing_on = false;
+// Started before the shards, converts stage timings to nanoseconds.
+static cycle_clock stage_clock;
+
+static seastar::httpd::http_server_control prometheus_server;
+
+// Read from --content-dir before the shards start, each shard serves from
+// its own copy.
+static content_cache content_source;
+
+// Upper bound of the buffer a single flush round packs packets into, and so
+// of what a connection may send per turn of the send scheduler.
+#define MAX_SEND_BATCH_SIZE 65536
+
+// A send round that couldn't allocate a burst buffer is retried after this
+// long.
+#define SEND_BUFFER_RETRY_MS 1
+
+// Stream data is read in chunks of this size into a per-shard buffer.
+#define STREAM_SCRATCH_SIZE 65536
+
+// A stream is not read while more than this much of its echo is waiting
+// for flow control. quiche then stops extending the peer's credit, which
+// pushes the backpressure back to the sender.
+#define STREAM_BACKLOG_LIMIT (256 * 1024)
+
+// HTTP/3 application error codes (RFC 9114, section 8.1).
+#define H3_NO_ERROR 0x100
+#define H3_INTERNAL_ERROR 0x102
+#define H3_REQUEST_REJECTED 0x10b
+
+// Stage timings are exported in power of two buckets from 2^5 ns up to
+// 2^24 ns (~16 ms).
+#define STAGE_METRIC_MIN_SHIFT 5
+#define STAGE_METRIC_BUCKETS 20
+
+// Connection timers are kept with a resolution of 2^17 ns (~131 us).
+#define CONN_TIMER_TICK_SHIFT 17
+
+// Packet type quiche_header_info() reports for Initial packets.
+#define QUIC_PACKET_TYPE_INITIAL 1
+
+// Events per second over the last second, estimated from the counts of the
+// current and the previous whole second.
+class rate_estimator {
+    uint64_t _second = 0;
+    uint64_t _current = 0;
+    uint64_t _previous = 0;
+
+    void roll(uint64_t now_ms) {
+        uint64_t second = now_ms / 1000;
+        if (second != _second) {
+            _previous = second == _second + 1 ? _current : 0;
+            _current = 0;
+            _second = second;
+        }
+    }
+
+public:
+    void add(uint64_t now_ms) {
+        roll(now_ms);
+        _current++;
+    }
+
+    double rate(uint64_t now_ms) {
+        roll(now_ms);
+        double elapsed = (now_ms % 1000) / 1000.0;
+        return _previous * (1 - elapsed) + _current;
+    }
+};
+
+// Server state is per shard: a connection lives on the shard encoded in its
+// connection ID and is only ever touched from there.
+static thread_local quiche_config *config = NULL;
+static thread_local quiche_h3_config *h3_config = NULL;
+static thread_local content_cache content_cache_shard;
+static thread_local udp_channel *local_chan = NULL;
+// local_chan's implementation when the server owns the socket.
+static thread_local udp_socket_channel *local_socket = NULL;
+static thread_local slab_pool<conn_io> conn_pool;
+// Burst buffers; chunks come back once all datagrams sliced from them are
+// sent. How much stays idle is set from the egress limit at startup.
+static thread_local buffer_pool burst_buffers(MAX_SEND_BATCH_SIZE, 0);
+static thread_local conn_table clients;
+static thread_local timer_wheel *conn_timers = NULL;
+// Single reactor timer, armed for the earliest deadline on the wheel.
+static thread_local seastar::timer<seastar::steady_clock_type> *conn_timers_driver = NULL;
+static thread_local pacer *egress_pacer = NULL;
+static thread_local egress_limiter *egress = NULL;
+static thread_local token_keys retry_keys;
+// Initials without a token, which decide whether new clients get a Retry.
+static thread_local rate_estimator connection_attempts;
+// Connections accepted without Retry, by the connection ID the client
+// picked, until their handshake completes.
+static thread_local std::unordered_map<odcid_key, struct conn_io *, odcid_hash> pending_odcids;
+// Connections with output pending, served round robin.
+static thread_local send_queue ready_conns;
+static thread_local bool send_round_pending = false;
+// Datagrams of one recvmmsg() on the server's own socket, and the order
+// they're handled in: (peer key, index) pairs.
+static thread_local std::vector<received_datagram> ingress;
+static thread_local std::vector<std::pair<uint64_t, uint32_t>> ingress_order;
+// Stream data is read into this before it's echoed.
+static thread_local uint8_t stream_scratch[STREAM_SCRATCH_SIZE];
+static thread_local stage_timer stage_timing;
+
+// Transport counters of one shard, exported through seastar::metrics.
+struct quic_stats {
+    uint64_t datagrams_received = 0;
+    // recvmmsg() calls on the server's own socket, wakeups of the receive
+    // loop on seastar's channel; datagrams_received over this is the mean
+    // batch size.
+    uint64_t receive_batches = 0;
+    uint64_t bytes_received = 0;
+    uint64_t datagrams_sent = 0;
+    uint64_t bytes_sent = 0;
+    uint64_t datagrams_forwarded = 0;
+    uint64_t header_errors = 0;
+    uint64_t version_negotiations = 0;
+    uint64_t retries = 0;
+    uint64_t invalid_tokens = 0;
+    uint64_t handshakes = 0;
+    // Connections that took 0-RTT data from a resumed session.
+    uint64_t early_data_accepted = 0;
+    // Connections not yet established (a gauge).
+    uint64_t handshakes_in_progress = 0;
+    // Initials dropped because max_handshakes were in progress.
+    uint64_t handshakes_refused = 0;
+    // Connections accepted without a Retry round trip.
+    uint64_t retries_skipped = 0;
+    uint64_t streams_opened = 0;
+    uint64_t http3_requests = 0;
+    uint64_t dgrams_received = 0;
+    uint64_t dgrams_echoed = 0;
+    // Echoes dropped from a full DATAGRAM send queue.
+    uint64_t dgrams_dropped = 0;
+    // Echoed bytes waiting for stream flow control (a gauge).
+    uint64_t stream_backlog_bytes = 0;
+    // Times a connection or the shard ran out of egress budget.
+    uint64_t egress_stalls = 0;
+    // Version negotiation and Retry packets dropped for lack of budget.
+    uint64_t egress_drops = 0;
+    // Packet counts of connections that were already reaped.
+    uint64_t reaped_sent_packets = 0;
+    uint64_t reaped_lost_packets = 0;
+    uint64_t reaped_retrans_packets = 0;
+};
+
+static thread_local quic_stats stats;
+
+static void expire_conn_timers();
+
+static uint64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            seastar::steady_clock_type::now().time_since_epoch()).count();
+}
+
+// Coarse monotonic time tokens are stamped with; the same on every shard.
+static uint64_t token_now_s() {
+    return std::chrono::duration_cast<std::chrono::seconds>(
+            seastar::lowres_clock::now().time_since_epoch()).count();
+}
+
+
+// Aggregates quiche's per connection statistics over the live connections of
+// this shard; only runs when metrics are scraped.
+struct conn_aggregate {
+    uint64_t sent_packets = 0;
+    uint64_t lost_packets = 0;
+    uint64_t retrans_packets = 0;
+    uint64_t rtt_sum_ns = 0;
+    uint64_t cwnd_sum = 0;
+    uint64_t paths = 0;
+};
+
+static conn_aggregate aggregate_conns() {
+    conn_aggregate agg;
+
+    clients.for_each([&agg](const uint8_t *, struct conn_io *conn_io) {
+        quiche_stats conn_stats;
+        quiche_conn_stats(conn_io->conn, &conn_stats);
+        agg.sent_packets += conn_stats.sent;
+        agg.lost_packets += conn_stats.lost;
+        agg.retrans_packets += conn_stats.retrans;
+
+        quiche_path_stats path_stats;
+        if (quiche_conn_path_stats(conn_io->conn, 0, &path_stats) == 0) {
+            agg.rtt_sum_ns += path_stats.rtt;
+            agg.cwnd_sum += path_stats.cwnd;
+            agg.paths++;
+        }
+    });
+
+    return agg;
+}
+
+// One stage's timings as a Prometheus histogram. quiche_histogram buckets
+// are folded into the first power of two bucket their upper edge fits in.
+static sm::histogram stage_metric(hot_stage stage) {
+    const log_histogram &h = stage_timing.histograms().stages[stage];
+    double ns_per_cycle = stage_clock.ns_per_cycle();
+
+    sm::histogram hist;
+    hist.sample_count = h.count();
+    hist.sample_sum = h.sum() * ns_per_cycle;
+    hist.buckets.resize(STAGE_METRIC_BUCKETS);
+
+    unsigned b = 0;
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < STAGE_METRIC_BUCKETS; i++) {
+        double bound = (double) ((uint64_t) 1 << (STAGE_METRIC_MIN_SHIFT + i));
+        while (b < HISTOGRAM_BUCKETS && log_histogram::bucket_high(b) * ns_per_cycle <= bound) {
+            seen += h.bucket_count(b);
+            b++;
+        }
+        hist.buckets[i].upper_bound = bound;
+        hist.buckets[i].count = seen;
+    }
+
+    return hist;
+}
+
+static std::unique_ptr<sm::metric_groups> register_metrics() {
+    auto groups = std::make_unique<sm::metric_groups>();
+
+    groups->add_group("quic", {
+            sm::make_counter("datagrams_received", stats.datagrams_received,
+                             sm::description("UDP datagrams received on this shard")),
+            sm::make_counter("receive_batches", stats.receive_batches,
+                             sm::description("recvmmsg calls on the server's own socket, receive wakeups otherwise")),
+            sm::make_counter("bytes_received", stats.bytes_received,
+                             sm::description("UDP payload bytes received on this shard")),
+            sm::make_counter("datagrams_sent", stats.datagrams_sent,
+                             sm::description("UDP datagrams sent")),
+            sm::make_counter("bytes_sent", stats.bytes_sent,
+                             sm::description("UDP payload bytes sent")),
+            sm::make_counter("datagrams_forwarded", stats.datagrams_forwarded,
+                             sm::description("datagrams handed over to the shard owning their connection")),
+            sm::make_counter("header_errors", stats.header_errors,
+                             sm::description("datagrams whose QUIC header could not be parsed")),
+            sm::make_counter("version_negotiations", stats.version_negotiations,
+                             sm::description("version negotiation packets sent")),
+            sm::make_counter("retries", stats.retries,
+                             sm::description("Retry packets sent")),
+            sm::make_counter("invalid_tokens", stats.invalid_tokens,
+                             sm::description("Initial packets with an address validation token that failed to validate")),
+            sm::make_counter("handshakes", stats.handshakes,
+                             sm::description("handshakes completed")),
+            sm::make_counter("early_data_accepted", stats.early_data_accepted,
+                             sm::description("handshakes that accepted 0-RTT data from a resumed session")),
+            sm::make_gauge("handshakes_in_progress", stats.handshakes_in_progress,
+                           sm::description("connections whose handshake is not complete")),
+            sm::make_counter("handshakes_refused", stats.handshakes_refused,
+                             sm::description("Initial packets dropped at the in-progress handshake limit")),
+            sm::make_counter("retries_skipped", stats.retries_skipped,
+                             sm::description("connections accepted without address validation, below the Retry threshold")),
+            sm::make_counter("streams_opened", stats.streams_opened,
+                             sm::description("streams opened by peers")),
+            sm::make_counter("http3_requests", stats.http3_requests,
+                             sm::description("HTTP/3 requests received")),
+            sm::make_counter("dgrams_received", stats.dgrams_received,
+                             sm::description("DATAGRAM frames received")),
+            sm::make_counter("dgrams_echoed", stats.dgrams_echoed,
+                             sm::description("DATAGRAM frames queued for echoing")),
+            sm::make_counter("dgrams_dropped", stats.dgrams_dropped,
+                             sm::description("queued DATAGRAM echoes dropped to make room for newer ones")),
+            sm::make_gauge("stream_backlog_bytes", stats.stream_backlog_bytes,
+                           sm::description("echoed bytes waiting for stream flow control")),
+            sm::make_gauge("egress_bytes", [] { return egress != NULL ? egress->in_flight() : 0; },
+                           sm::description("bytes of outgoing datagrams not yet taken by the kernel")),
+            sm::make_counter("egress_stalls", stats.egress_stalls,
+                             sm::description("times sending paused on the connection or shard egress limit")),
+            sm::make_counter("egress_drops", stats.egress_drops,
+                             sm::description("stateless packets dropped on the shard egress limit")),
+            sm::make_counter("send_failures", [] { return egress != NULL ? egress->failures() : 0; },
+                             sm::description("datagrams the socket failed to send")),
+            sm::make_counter("send_syscalls", [] { return local_socket != NULL ? local_socket->send_syscalls() : 0; },
+                             sm::description("sendmsg/sendmmsg calls on the server's own socket")),
+            sm::make_gauge("gso", [] { return local_socket != NULL && local_socket->gso() ? 1 : 0; },
+                           sm::description("1 while bursts are sent with UDP GSO, 0 after falling back to sendmmsg")),
+            sm::make_gauge("gro", [] { return local_socket != NULL && local_socket->gro() ? 1 : 0; },
+                           sm::description("1 if the kernel may coalesce received datagrams with UDP GRO")),
+            sm::make_gauge("send_queue", [] { return ready_conns.size(); },
+                           sm::description("connections waiting for their turn to send")),
+            sm::make_gauge("connections", [] { return clients.size(); },
+                           sm::description("live connections")),
+            sm::make_gauge("send_buffer_bytes", [] { return burst_buffers.allocated_bytes(); },
+                           sm::description("bytes of send buffers allocated, in flight or free for reuse")),
+            sm::make_gauge("connection_slots", [] { return conn_pool.capacity(); },
+                           sm::description("connection objects allocated, live or free for reuse")),
+            sm::make_counter("lost_packets", [] {
+                return stats.reaped_lost_packets + aggregate_conns().lost_packets;
+            }, sm::description("packets declared lost")),
+            sm::make_counter("retransmitted_packets", [] {
+                return stats.reaped_retrans_packets + aggregate_conns().retrans_packets;
+            }, sm::description("packets carrying retransmitted data")),
+            sm::make_gauge("rtt_avg_us", [] {
+                conn_aggregate agg = aggregate_conns();
+                return agg.paths ? agg.rtt_sum_ns / agg.paths / 1e3 : 0;
+            }, sm::description("mean smoothed RTT of the live connections, in microseconds")),
+            sm::make_gauge("cwnd_bytes", [] { return aggregate_conns().cwnd_sum; },
+                           sm::description("sum of the congestion windows of the live connections")),
+    });
 
-seastar::future<> start_quiche_server();
+    sm::label stage_label("stage");
+    for (unsigned s = 0; s < STAGE_COUNT; s++) {
+        groups->add_group("quic", {
+                sm::make_histogram("stage_ns", [s] { return stage_metric((hot_stage) s); },
+                                   sm::description("time per pass through a stage of the packet path, in nanoseconds"),
+                                   {stage_label(hot_stage_names[s])}),
+        });
+    }
+
+    return groups;
+}
+
+static seastar::future<> start_prometheus() {
+    if (prometheus_port == 0) {
+        return seastar::make_ready_future<>();
+    }
+
+    return prometheus_server.start("prometheus").then([] {
+        seastar::prometheus::config prometheus_config;
+        prometheus_config.prefix = "echo_server";
+        return seastar::prometheus::start(prometheus_server, prometheus_config);
+    }).then([] {
+        return prometheus_server.listen(seastar::socket_address(seastar::ipv4_addr(prometheus_port)));
+    });
+}
+
+// Switches stage timing on or off on every shard.
+static seastar::future<> toggle_stage_timing() {
+    stage_timing_on = !stage_timing_on;
+    bool on = stage_timing_on;
+    server_log.info("stage timing {}", on ? "on" : "off");
 
-void handle_connection(uint8_t *buf, ssize_t read, udp_channel &chan, udp_datagram &dgram);
+    return seastar::smp::invoke_on_all([on] {
+        stage_timing.set_enabled(on);
+    });
+}
+
+// Logs the stage timings of all shards, merged.
+static seastar::future<> dump_stage_timing() {
+    auto cores = boost::irange<unsigned>(0, seastar::smp::count);
+
+    return seastar::map_reduce(cores.begin(), cores.end(),
+                               [](unsigned core) {
+                                   return seastar::smp::submit_to(core, [] {
+                                       return stage_timing.histograms();
+                                   });
+                               },
+                               stage_histograms(),
+                               [](stage_histograms total, stage_histograms shard) {
+                                   return std::move(total.merge(shard));
+                               }).then([](stage_histograms total) {
+        double ns_per_cycle = stage_clock.ns_per_cycle();
+
+        server_log.info("stage timing is {}, times in ns:", stage_timing_on ? "on" : "off");
+        for (unsigned s = 0; s < STAGE_COUNT; s++) {
+            const log_histogram &h = total.stages[s];
+            server_log.info("{:>12}: {} samples, mean {:.0f}, p50 {:.0f}, p99 {:.0f}, p999 {:.0f}, max {:.0f}",
+                            hot_stage_names[s], h.count(), h.mean() * ns_per_cycle,
+                            h.quantile(0.5) * ns_per_cycle, h.quantile(0.99) * ns_per_cycle,
+                            h.quantile(0.999) * ns_per_cycle, h.max() * ns_per_cycle);
+        }
+    });
+}
+
+static seastar::future<> f() {
+    // Connection IDs name their shard in CID_SHARD_BYTES; with more shards
+    // some would route to the wrong one.
+    if (seastar::smp::count > CID_MAX_SHARDS) {
+        server_log.error("at most {} shards are supported, {} configured", CID_MAX_SHARDS, seastar::smp::count);
+        return seastar::make_ready_future<>();
+    }
+
+    if (getrandom(token_master_secret, sizeof(token_master_secret), 0) != sizeof(token_master_secret)) {
+        server_log.error("failed to generate the token secret: {}", strerror(errno));
+        return seastar::make_ready_future<>();
+    }
 
-static const int port = 1234;
-static quiche_config *config = NULL;
-std::map<std::vector<uint8_t>, conn_io *> clients;
+    if (http3_enabled && !content_dir.empty()) {
+        if (!content_source.load(content_dir)) {
+            server_log.error("failed to load content from {}", content_dir);
+            return seastar::make_ready_future<>();
+        }
+        server_log.info("serving {} files, {} bytes, from {}",
+                        content_source.size(), content_source.bytes(), content_dir);
+    }
 
+    stage_clock.start();
+    seastar::engine().handle_signal(SIGUSR1, [] {
+        (void) dump_stage_timing();
+    });
+    seastar::engine().handle_signal(SIGUSR2, [] {
+        (void) toggle_stage_timing();
+    });
 
-seastar::future<> f() {
     return seastar::parallel_for_each(boost::irange<unsigned>(0, seastar::smp::count),
                                       [](unsigned c) {
                                           return seastar::smp::submit_to(c, start_quiche_server);
@@ -33,75 +473,832 @@ seastar::future<> f() {
 }
 
 
-seastar::future<> start_quiche_server() {
-    seastar::ipv4_addr listen_addr{port};
-    auto chan = seastar::make_udp_channel(listen_addr);
+// Returns the payload of a datagram as one contiguous, writable buffer.
+// Single fragment packets (the common case) are used in place, quiche
+// decrypts straight in the packet's memory. Only fragmented packets are
+// copied, into a buffer reused for the whole shard. Returns NULL if the
+// payload doesn't fit.
+static uint8_t *contiguous_payload(net::packet &p) {
+    net::fragment *frags = p.fragment_array();
+    if (p.nr_frags() == 1) {
+        return reinterpret_cast<uint8_t *>(frags[0].base);
+    }
+
+    if (p.len() > MAX_UDP_PAYLOAD) {
+        return NULL;
+    }
+
+    static thread_local std::unique_ptr<uint8_t[]> linear;
+    if (!linear) {
+        linear.reset(new uint8_t[MAX_UDP_PAYLOAD]);
+    }
+
+    size_t off = 0;
+    for (unsigned i = 0; i < p.nr_frags(); i++) {
+        memcpy(linear.get() + off, frags[i].base, frags[i].size);
+        off += frags[i].size;
+    }
+
+    return linear.get();
+}
+
+static void receive_datagram(udp_datagram &dgram, udp_channel &chan) {
+    net::packet &p = dgram.get_data();
+    stats.datagrams_received++;
+    stats.bytes_received += p.len();
+
+    uint8_t *buf = contiguous_payload(p);
+    if (buf == NULL) {
+        QLOG_LIMITED(server_log, seastar::log_level::warn,
+                     "dropping oversized datagram: {} bytes", p.len());
+        return;
+    }
+
+    // Feed the raw data into quiche and handle the connection
+    handle_connection(buf, p.len(), chan, dgram.get_src(), dgram.get_dst());
+}
+
+// Seastar's channel (--gso=false, and the simulated network) has no
+// batched receive. Processes the datagrams the channel already has, up to a
+// batch, in the continuation that woke up for the first one instead of a
+// reactor round trip each. Connections only send after the batch (see
+// schedule_send), so one flush acknowledges everything a connection
+// received in it. The first receive that has to wait ends the batch, its
+// datagram starts the next one.
+static seastar::future<> receive_ready(udp_channel &chan) {
+    for (unsigned n = 1; n < ingress_batch; n++) {
+        auto next = chan.receive();
+        if (!next.available() || next.failed()) {
+            return next.then([&chan](udp_datagram dgram) {
+                stats.receive_batches++;
+                receive_datagram(dgram, chan);
+                return receive_ready(chan);
+            });
+        }
+
+        udp_datagram dgram = next.get0();
+        receive_datagram(dgram, chan);
+    }
+
+    return seastar::make_ready_future<>();
+}
+
+// Groups datagrams by peer: the same address and port give the same key.
+// Peers sharing a key (IPv6 addresses are folded) only interleave.
+static uint64_t peer_key(const socket_address &addr) {
+    if (addr.u.sa.sa_family == AF_INET6) {
+        uint64_t hi, lo;
+        memcpy(&hi, &addr.u.in6.sin6_addr, sizeof(hi));
+        memcpy(&lo, reinterpret_cast<const uint8_t *>(&addr.u.in6.sin6_addr) + sizeof(hi), sizeof(lo));
+        return (hi * 0x9e3779b97f4a7c15ULL) ^ lo ^ ((uint64_t) addr.u.in6.sin6_port << 48);
+    }
+
+    return ((uint64_t) addr.u.in.sin_addr.s_addr << 16) | addr.u.in.sin_port;
+}
+
+// Handles what one recvmmsg() took off the server's own socket. Datagrams
+// go through quiche grouped by peer, each peer's in the order they
+// arrived, so a connection's datagrams are processed back to back; the
+// connections send once the whole batch is in (see schedule_send).
+static void receive_socket_batch() {
+    stats.receive_batches++;
+    socket_address dst = local_socket->local_address();
+
+    ingress_order.clear();
+    for (uint32_t i = 0; i < ingress.size(); i++) {
+        ingress_order.emplace_back(peer_key(ingress[i].src), i);
+    }
+    std::sort(ingress_order.begin(), ingress_order.end());
+
+    for (auto &[key, i] : ingress_order) {
+        received_datagram &dgram = ingress[i];
+        stats.datagrams_received++;
+        stats.bytes_received += dgram.data.size();
+        handle_connection(reinterpret_cast<uint8_t *>(dgram.data.get_write()), dgram.data.size(),
+                          *local_chan, dgram.src, dst);
+    }
+
+    ingress.clear();
+}
+
+static seastar::future<> start_quiche_server() {
+    seastar::ipv4_addr listen_addr{settings.port};
+    auto chan = gso_enabled && shard_sim_network == nullptr
+                ? make_udp_socket_channel(listen_addr, &local_socket)
+                : make_quic_channel(listen_addr);
 
     // Set up quiche.
-    setup_config(&config);
+    setup_config(&config, settings);
 
     if (config == NULL) {
-        std::cout << "Failed to create quiche config" << std::endl;
+        server_log.error("failed to create quiche config");
         return seastar::make_ready_future<>();
     }
 
-    return seastar::do_with(std::move(chan), [](auto &chan) {
-        return seastar::keep_doing([&chan] {
-            std::cout << "Waiting for some data...\n";
-            return chan.receive().then([&chan](udp_datagram dgram) {
-                // Convert seastar udp datagram into raw data
-                uint8_t buffer[MAX_DATAGRAM_SIZE];
-                auto fragment_array = dgram.get_data().fragment_array();
-                memcpy(buffer, fragment_array->base, fragment_array->size);
+    quiche_config_enable_dgram(config, dgram_enabled && !http3_enabled, DGRAM_QUEUE_LEN, DGRAM_QUEUE_LEN);
 
-                // Feed the raw data into quiche and handle the connection
-                handle_connection(buffer, fragment_array->size, chan, dgram);
+    if (http3_enabled) {
+        quiche_config_set_application_protos(config, (uint8_t *) QUICHE_H3_APPLICATION_PROTOCOL,
+                                             sizeof(QUICHE_H3_APPLICATION_PROTOCOL) - 1);
 
+        h3_config = quiche_h3_config_new();
+        if (h3_config == NULL) {
+            server_log.error("failed to create HTTP/3 config");
+            return seastar::make_ready_future<>();
+        }
+
+        content_cache_shard = content_source;
+    }
+
+    return seastar::do_with(std::move(chan),
+                            std::make_unique<timer_wheel>(CONN_TIMER_TICK_SHIFT, now_ns()),
+                            seastar::timer<seastar::steady_clock_type>(expire_conn_timers),
+                            std::unique_ptr<egress_limiter>(),
+                            std::unique_ptr<pacer>(),
+                            register_metrics(),
+                            [](auto &chan, auto &timers, auto &timers_driver, auto &limiter, auto &paced, auto &) {
+        local_chan = &chan;
+        conn_timers = timers.get();
+        conn_timers_driver = &timers_driver;
+        limiter = std::make_unique<egress_limiter>(chan, local_socket, settings.egress_limit,
+                                                   settings.conn_egress_limit, egress_drained);
+        egress = limiter.get();
+        // Bursts in flight are bounded by the egress limit, so is what's
+        // worth keeping around for them.
+        burst_buffers.set_max_free_bytes(settings.egress_limit);
+        stage_timing.set_enabled(stage_timing_on);
+        if (settings.pacing) {
+            paced = std::make_unique<pacer>(*limiter);
+            egress_pacer = paced.get();
+        }
+        if (local_socket != NULL) {
+            return seastar::keep_doing([] {
+                QLOG_TRACE(server_log, "waiting for data");
+                return local_socket->receive_batch(ingress_batch, ingress).then(receive_socket_batch);
+            });
+        }
+        return seastar::keep_doing([&chan] {
+            QLOG_TRACE(server_log, "waiting for data");
+            return chan.receive().then([&chan](udp_datagram dgram) {
+                stats.receive_batches++;
+                receive_datagram(dgram, chan);
+                return receive_ready(chan);
             });
         });
     });
 }
 
-static void send_data(struct conn_io *conn_data, udp_channel &chan, udp_datagram &dgram) {
-    static uint8_t out[MAX_DATAGRAM_SIZE];
+static socket_address to_socket_address(const struct sockaddr_storage &addr) {
+    if (addr.ss_family == AF_INET6) {
+        return socket_address(*reinterpret_cast<const sockaddr_in6 *>(&addr));
+    }
 
+    return socket_address(*reinterpret_cast<const sockaddr_in *>(&addr));
+}
+
+enum burst_result {
+    // quiche has nothing more to send.
+    BURST_DONE,
+    // The buffer filled up before quiche ran out of packets.
+    BURST_MORE,
+    // The connection's egress limit is reached, it's woken when it drains.
+    BURST_CONN_BLOCKED,
+    // The shard's egress limit is reached.
+    BURST_SHARD_BLOCKED,
+    // No send buffer could be allocated; quiche still has the packets.
+    BURST_NO_BUFFER,
+};
+
+// Sends one burst of a connection's packets. The burst buffer is sized from
+// the connection's send quantum and taken from the shard's buffer pool;
+// quiche writes its packets back to back into it; the datagrams are sent
+// as slices of that buffer, so a burst costs no copies and, once the pool
+// is warm, no large allocation. Packets that are due go out together as a
+// segment_run, in a single GSO send on the server's own socket. With
+// pacing on, packets not due yet go through the shard's pacer instead.
+// The whole buffer is reserved from the egress limits up front, the unused
+// rest is returned.
+static burst_result send_burst(struct conn_io *conn_data) {
     quiche_send_info send_info;
+    segment_run run;
+
+    size_t quantum = std::clamp(quiche_conn_send_quantum(conn_data->conn),
+                                settings.max_payload, (size_t) MAX_SEND_BATCH_SIZE);
+    if (!egress->reserve(conn_data->egress.get(), quantum)) {
+        stats.egress_stalls++;
+        return egress->stalled() ? BURST_SHARD_BLOCKED : BURST_CONN_BLOCKED;
+    }
+
+    seastar::temporary_buffer<char> batch = burst_buffers.get(quantum);
+    if (batch.empty()) {
+        egress->unreserve(conn_data->egress.get(), quantum);
+        QLOG_LIMITED(server_log, seastar::log_level::warn, "failed to allocate a send buffer");
+        return BURST_NO_BUFFER;
+    }
+    size_t off = 0;
 
-    while (1) {
-        ssize_t written = quiche_conn_send(conn_data->conn, out, sizeof(out),
-                                           &send_info);
+    while (batch.size() - off >= settings.max_payload) {
+        uint64_t started = stage_timing.start();
+        ssize_t written = quiche_conn_send(conn_data->conn,
+                                           reinterpret_cast<uint8_t *>(batch.get_write()) + off,
+                                           batch.size() - off, &send_info);
+        stage_timing.stop(STAGE_PACKETIZE, started);
 
         if (written == QUICHE_ERR_DONE) {
-            break;
+            started = stage_timing.start();
+            egress->send(run);
+            stage_timing.stop(STAGE_SUBMIT, started);
+            egress->unreserve(conn_data->egress.get(), batch.size() - off);
+            return BURST_DONE;
         }
 
         if (written < 0) {
-            fprintf(stderr, "failed to create packet: %zd\n", written);
+            server_log.error("failed to create packet: {}", written);
             exit(1);
         }
 
-        (void) chan.send(dgram.get_src(),
-                         seastar::temporary_buffer<char>(reinterpret_cast<const char *>(out), written));
+        stats.datagrams_sent++;
+        stats.bytes_sent += written;
+
+        started = stage_timing.start();
+        socket_address to = to_socket_address(send_info.to);
+        uint64_t at = pacer::to_ns(send_info.at);
+        if (egress_pacer != NULL && !egress_pacer->due(at)) {
+            // Whatever is due goes first, the pacer keeps the order of the
+            // rest.
+            egress->send(run);
+            egress_pacer->send(at, conn_data->egress, to, batch.share(off, written));
+        } else {
+            if (!run.fits(conn_data->egress.get(), to, written)) {
+                egress->send(run);
+            }
+            run.add(conn_data->egress, to, batch.share(off, written));
+        }
+        stage_timing.stop(STAGE_SUBMIT, started);
+        off += written;
+    }
+
+    started = stage_timing.start();
+    egress->send(run);
+    stage_timing.stop(STAGE_SUBMIT, started);
+    egress->unreserve(conn_data->egress.get(), batch.size() - off);
+    return BURST_MORE;
+}
+
+static struct conn_io *conn_of_timer(struct timer_wheel_entry *timer) {
+    return reinterpret_cast<struct conn_io *>(reinterpret_cast<char *>(timer) - offsetof(struct conn_io, timer));
+}
+
+static void arm_conn_timers() {
+    uint64_t next = conn_timers->next_deadline_ns();
+    if (next == UINT64_MAX) {
+        return;
+    }
+
+    auto at = seastar::steady_clock_type::time_point(std::chrono::nanoseconds(next));
+    if (!conn_timers_driver->armed() || at < conn_timers_driver->get_timeout()) {
+        conn_timers_driver->rearm(at);
+    }
+}
+
+static uint64_t now_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+            seastar::lowres_clock::now().time_since_epoch()).count();
+}
 
+// Stops routing the client's original connection ID to the connection.
+static void forget_odcid(struct conn_io *conn_io) {
+    if (conn_io->odcid_len == 0) {
+        return;
     }
+
+    pending_odcids.erase(odcid_key(conn_io->odcid, conn_io->odcid_len));
+    conn_io->odcid_len = 0;
 }
 
-void handle_connection(uint8_t *buf, ssize_t read, udp_channel &chan, udp_datagram &dgram) {
-    struct conn_io *conn_io = NULL;
+static struct conn_io *find_pending(const uint8_t *dcid, size_t dcid_len) {
+    if (pending_odcids.empty()) {
+        return NULL;
+    }
+
+    auto it = pending_odcids.find(odcid_key(dcid, dcid_len));
+    return it == pending_odcids.end() ? NULL : it->second;
+}
+
+static void reap_conn(struct conn_io *conn_io) {
+    quiche_stats conn_stats;
+    quiche_conn_stats(conn_io->conn, &conn_stats);
+    stats.reaped_sent_packets += conn_stats.sent;
+    stats.reaped_lost_packets += conn_stats.lost;
+    stats.reaped_retrans_packets += conn_stats.retrans;
+
+    stats.stream_backlog_bytes -= conn_io->backlog_bytes;
+    if (!conn_io->established) {
+        stats.handshakes_in_progress--;
+    }
+    forget_odcid(conn_io);
+    conn_io->egress->owner = NULL;
+
+    conn_timers->cancel(&conn_io->timer);
+    ready_conns.remove(&conn_io->send_entry);
+    clients.erase(conn_io->cid);
+    conn_pool.destroy(conn_io);
+}
+
+// Puts the connection's next quiche timeout on the wheel, or frees the
+// connection once quiche considers it closed.
+static void update_conn_timer(struct conn_io *conn_io) {
+    if (quiche_conn_is_closed(conn_io->conn)) {
+        reap_conn(conn_io);
+        return;
+    }
+
+    uint64_t timeout = quiche_conn_timeout_as_nanos(conn_io->conn);
+    if (timeout == UINT64_MAX) {
+        conn_timers->cancel(&conn_io->timer);
+        return;
+    }
+
+    conn_timers->schedule(&conn_io->timer, now_ns() + timeout);
+    arm_conn_timers();
+}
+
+static struct conn_io *conn_of_send_entry(struct send_queue_entry *entry) {
+    return reinterpret_cast<struct conn_io *>(reinterpret_cast<char *>(entry) - offsetof(struct conn_io, send_entry));
+}
+
+static void run_send_round();
+
+// Queues a connection to send whatever quiche has for it. Sending happens
+// in a separate task, so everything that woke the connection in the
+// meantime (datagrams, stream data, timers) is flushed together.
+static void schedule_send(struct conn_io *conn_io) {
+    ready_conns.push_back(&conn_io->send_entry);
+
+    if (!send_round_pending && !egress->stalled()) {
+        send_round_pending = true;
+        (void) seastar::yield().then(run_send_round);
+    }
+}
+
+// Gives each queued connection one burst. Connections with more to send go
+// to the back of the queue and continue in the next round, which runs after
+// the tasks that became ready in between, so a bulk transfer neither
+// starves other connections nor the receive path. Once the shard's egress
+// budget runs out the round stops, the connections still queued wait until
+// the socket has drained part of it.
+static void run_send_round() {
+    send_round_pending = false;
+
+    for (size_t n = ready_conns.size(); n > 0; n--) {
+        struct conn_io *conn_io = conn_of_send_entry(ready_conns.pop_front());
+
+        burst_result res = send_burst(conn_io);
+        if (res == BURST_MORE) {
+            schedule_send(conn_io);
+        } else if (res == BURST_SHARD_BLOCKED || res == BURST_NO_BUFFER) {
+            ready_conns.push_back(&conn_io->send_entry);
+        }
+        // Also when the round stops here: the connection may wait for the
+        // socket longer than its next loss recovery or idle timeout.
+        update_conn_timer(conn_io);
+        if (res == BURST_SHARD_BLOCKED) {
+            break;
+        }
+        // Nothing signals when memory comes back, the queue is tried again
+        // a little later.
+        if (res == BURST_NO_BUFFER) {
+            if (!send_round_pending) {
+                send_round_pending = true;
+                (void) seastar::sleep(std::chrono::milliseconds(SEND_BUFFER_RETRY_MS)).then(run_send_round);
+            }
+            break;
+        }
+    }
+}
+
+// Called by the egress limiter as budget frees up: with a connection that
+// drained below its own limit, or with NULL when the shard may send again.
+static void egress_drained(void *owner) {
+    if (owner != NULL) {
+        schedule_send(static_cast<struct conn_io *>(owner));
+    } else if (!ready_conns.empty() && !send_round_pending) {
+        send_round_pending = true;
+        (void) seastar::yield().then(run_send_round);
+    }
+}
+
+static void expire_conn_timers() {
+    conn_timers->advance(now_ns(), [](struct timer_wheel_entry *timer) {
+        struct conn_io *conn_io = conn_of_timer(timer);
+
+        quiche_conn_on_timeout(conn_io->conn);
+        schedule_send(conn_io);
+        update_conn_timer(conn_io);
+    });
+
+    arm_conn_timers();
+}
+
+// Returns the shard owning the connection a packet with the given DCID belongs
+// to. IDs we could not have minted stay on the receiving shard; since the
+// mapping only depends on the DCID, all packets carrying the same client-chosen
+// ID still end up on a single shard.
+static unsigned owner_shard(const uint8_t *dcid, size_t dcid_len) {
+    unsigned shard = cid_shard(dcid, dcid_len);
+    if (shard >= seastar::smp::count) {
+        return seastar::this_shard_id();
+    }
+
+    return shard;
+}
+
+// Hands a datagram over to the shard owning its connection. The payload is
+// copied, the packet itself belongs to the receiving shard.
+static void forward_datagram(unsigned owner, const uint8_t *buf, size_t len,
+                             const socket_address &src, const socket_address &dst) {
+    seastar::temporary_buffer<char> data(reinterpret_cast<const char *>(buf), len);
+    stats.datagrams_forwarded++;
+
+    (void) seastar::smp::submit_to(owner, [data = std::move(data), src, dst]() mutable {
+        if (local_chan == NULL) {
+            return;
+        }
+
+        handle_connection(reinterpret_cast<uint8_t *>(data.get_write()), data.size(),
+                          *local_chan, src, dst);
+    });
+}
+
+// Peers open the streams of one type in order, so every stream up to a
+// newly seen ID has been opened by now.
+static void count_new_stream(struct conn_io *conn_io, uint64_t stream_id) {
+    uint64_t &next = conn_io->next_peer_stream[(stream_id >> 1) & 1];
+    uint64_t seq = stream_id >> 2;
+
+    if (seq >= next) {
+        stats.streams_opened += seq - next + 1;
+        next = seq + 1;
+    }
+}
+
+static void drop_backlog(struct conn_io *conn_io, std::map<uint64_t, stream_backlog>::iterator it) {
+    conn_io->backlog_bytes -= it->second.size();
+    stats.stream_backlog_bytes -= it->second.size();
+    conn_io->backlog.erase(it);
+}
 
-    static char out[MAX_DATAGRAM_SIZE];
+// Writes to a stream, framed as HTTP/3 body data on HTTP/3 connections.
+// Returns QUICHE_ERR_DONE if the stream has no room at all.
+static ssize_t stream_write(struct conn_io *conn_io, uint64_t s,
+                            const uint8_t *data, size_t len, bool fin) {
+    if (conn_io->http3 != NULL) {
+        ssize_t rc = quiche_h3_send_body(conn_io->http3, conn_io->conn, s,
+                                         const_cast<uint8_t *>(data), len, fin);
+        return rc == QUICHE_H3_ERR_STREAM_BLOCKED ? QUICHE_ERR_DONE : rc;
+    }
+
+    return quiche_conn_stream_send(conn_io->conn, s, data, len, fin);
+}
+
+// Writes `len` bytes to stream `s`, behind anything already waiting there.
+// Whatever flow control doesn't let through now goes to the stream's
+// backlog; with `borrow`, `data` outlives the stream and is queued by
+// reference instead of copied. Returns the bytes left in the backlog.
+static size_t queue_stream_data(struct conn_io *conn_io, uint64_t s,
+                                const uint8_t *data, size_t len, bool fin,
+                                bool borrow = false) {
+    auto it = conn_io->backlog.find(s);
+
+    size_t written = 0;
+    if (it == conn_io->backlog.end()) {
+        ssize_t rc = stream_write(conn_io, s, data, len, fin);
+        if (rc >= 0 && (size_t) rc == len) {
+            return 0;
+        }
+        if (rc < 0 && rc != QUICHE_ERR_DONE) {
+            QLOG_DEBUG(server_log, "stream {} not writable: {}", s, rc);
+            return 0;
+        }
+        written = rc < 0 ? 0 : rc;
+        it = conn_io->backlog.emplace(s, stream_backlog()).first;
+
+        if (borrow) {
+            stream_backlog &b = it->second;
+            b.borrowed = data;
+            b.borrowed_len = len;
+            b.off = written;
+            b.fin = fin;
+            conn_io->backlog_bytes += len - written;
+            stats.stream_backlog_bytes += len - written;
+            return b.size();
+        }
+    }
+
+    stream_backlog &b = it->second;
+    if (b.borrowed != NULL && len > 0) {
+        b.data.assign(b.begin(), b.begin() + b.size());
+        b.off = 0;
+        b.borrowed = NULL;
+        b.borrowed_len = 0;
+    }
+
+    b.data.insert(b.data.end(), data + written, data + len);
+    b.fin = b.fin || fin;
+    conn_io->backlog_bytes += len - written;
+    stats.stream_backlog_bytes += len - written;
+
+    return b.size();
+}
+
+static void h3_read_body(struct conn_io *conn_io, uint64_t s);
+
+// Writes out backlogs of the streams flow control has made room on.
+static void flush_backlogs(struct conn_io *conn_io) {
+    if (conn_io->backlog.empty()) {
+        return;
+    }
+
+    quiche_stream_iter *writable = quiche_conn_writable(conn_io->conn);
+    uint64_t s = 0;
+
+    while (quiche_stream_iter_next(writable, &s)) {
+        auto it = conn_io->backlog.find(s);
+        if (it == conn_io->backlog.end()) {
+            continue;
+        }
+
+        stream_backlog &b = it->second;
+        ssize_t written = stream_write(conn_io, s, b.begin(), b.size(), b.fin);
+        if (written == QUICHE_ERR_DONE) {
+            continue;
+        }
+        if (written < 0) {
+            QLOG_DEBUG(server_log, "stream {} not writable: {}", s, written);
+            drop_backlog(conn_io, it);
+            continue;
+        }
+
+        b.off += written;
+        conn_io->backlog_bytes -= written;
+        stats.stream_backlog_bytes -= written;
+
+        bool resume = b.read_paused && b.size() < STREAM_BACKLOG_LIMIT;
+        if (resume) {
+            b.read_paused = false;
+        }
+
+        if (b.size() == 0) {
+            conn_io->backlog.erase(it);
+        } else if (b.borrowed == NULL && b.off >= b.data.size() / 2) {
+            b.data.erase(b.data.begin(), b.data.begin() + b.off);
+            b.off = 0;
+        }
+
+        if (resume) {
+            h3_read_body(conn_io, s);
+        }
+    }
+
+    quiche_stream_iter_free(writable);
+}
+
+// Drains every readable stream and echoes it back, except for streams
+// whose backlog is over STREAM_BACKLOG_LIMIT; those stay readable and are
+// picked up again once their backlog shrinks.
+static void echo_readable(struct conn_io *conn_io) {
+    static const char *resp = "Stream finished.\n";
+
+    quiche_stream_iter *readable = quiche_conn_readable(conn_io->conn);
+    uint64_t s = 0;
+
+    while (quiche_stream_iter_next(readable, &s)) {
+        QLOG_TRACE(server_log, "stream {} is readable", s);
+        count_new_stream(conn_io, s);
+
+        auto it = conn_io->backlog.find(s);
+        size_t pending = it == conn_io->backlog.end() ? 0 : it->second.size();
+        bool fin = false;
+
+        while (!fin && pending < STREAM_BACKLOG_LIMIT) {
+            ssize_t recv_len = quiche_conn_stream_recv(conn_io->conn, s, stream_scratch,
+                                                       sizeof(stream_scratch), &fin);
+            if (recv_len < 0) {
+                if (recv_len != QUICHE_ERR_DONE) {
+                    QLOG_DEBUG(server_log, "stream {} not readable: {}", s, recv_len);
+                    it = conn_io->backlog.find(s);
+                    if (it != conn_io->backlog.end()) {
+                        drop_backlog(conn_io, it);
+                    }
+                }
+                break;
+            }
+
+            QLOG_TRACE(server_log, "received: {}", std::string_view(reinterpret_cast<const char *>(stream_scratch), recv_len));
 
+            pending = queue_stream_data(conn_io, s, stream_scratch, recv_len, false);
+        }
+
+        if (fin) {
+            queue_stream_data(conn_io, s, (const uint8_t *) resp, 5, true);
+        }
+    }
+
+    quiche_stream_iter_free(readable);
+}
+
+// Echoes every received DATAGRAM frame. The send queue is kept at
+// DGRAM_QUEUE_LEN by dropping its oldest entries: datagrams are for data
+// that isn't worth retransmitting, so it isn't worth queueing long either.
+static void echo_datagrams(struct conn_io *conn_io) {
+    while (true) {
+        ssize_t len = quiche_conn_dgram_recv(conn_io->conn, stream_scratch, sizeof(stream_scratch));
+        if (len < 0) {
+            if (len != QUICHE_ERR_DONE) {
+                QLOG_DEBUG(server_log, "failed to receive datagram: {}", len);
+            }
+            return;
+        }
+        stats.dgrams_received++;
+
+        dgram_stamp_echo(stream_scratch, len);
+        stats.dgrams_dropped += dgram_make_room(conn_io->conn, 1);
+
+        ssize_t rc = quiche_conn_dgram_send(conn_io->conn, stream_scratch, len);
+        if (rc < 0) {
+            QLOG_DEBUG(server_log, "failed to echo datagram: {}", rc);
+            stats.dgrams_dropped++;
+            continue;
+        }
+        stats.dgrams_echoed++;
+    }
+}
+
+// HTTP/3 mode: GET is answered from the shard's content cache, POST echoes
+// the request body back.
+
+struct h3_request {
+    std::string method;
+    std::string path;
+};
+
+static int collect_request_header(uint8_t *name, size_t name_len,
+                                  uint8_t *value, size_t value_len, void *argp) {
+    h3_request *req = static_cast<h3_request *>(argp);
+    std::string_view header(reinterpret_cast<const char *>(name), name_len);
+
+    if (header == ":method") {
+        req->method.assign(reinterpret_cast<const char *>(value), value_len);
+    } else if (header == ":path") {
+        req->path.assign(reinterpret_cast<const char *>(value), value_len);
+    }
+
+    return 0;
+}
+
+// Sends the response headers; `length` may be NULL for a body of unknown
+// length. A stream without room even for the headers is refused.
+static bool h3_respond(struct conn_io *conn_io, uint64_t s,
+                       const char *status, const char *length, bool fin) {
+    quiche_h3_header headers[] = {
+            {(const uint8_t *) ":status", 7, (const uint8_t *) status, strlen(status)},
+            {(const uint8_t *) "content-length", 14, (const uint8_t *) length, length ? strlen(length) : 0},
+    };
+
+    int rc = quiche_h3_send_response(conn_io->http3, conn_io->conn, s,
+                                     headers, length != NULL ? 2 : 1, fin);
+    if (rc < 0) {
+        QLOG_DEBUG(server_log, "failed to send response on stream {}: {}", s, rc);
+        quiche_conn_stream_shutdown(conn_io->conn, s, QUICHE_SHUTDOWN_READ, H3_REQUEST_REJECTED);
+        quiche_conn_stream_shutdown(conn_io->conn, s, QUICHE_SHUTDOWN_WRITE, H3_REQUEST_REJECTED);
+        return false;
+    }
 
-    sockaddr addr = dgram.get_src().as_posix_sockaddr();
-    socklen_t addr_len = sizeof(addr);
+    return true;
+}
+
+static void h3_handle_request(struct conn_io *conn_io, uint64_t s, quiche_h3_event *ev) {
+    h3_request req;
+    quiche_h3_event_for_each_header(ev, collect_request_header, &req);
+    bool has_body = quiche_h3_event_headers_has_body(ev);
+
+    QLOG_TRACE(server_log, "stream {}: {} {}", s, req.method, req.path);
+    count_new_stream(conn_io, s);
+    stats.http3_requests++;
+
+    if (req.method == "POST") {
+        if (h3_respond(conn_io, s, "200", NULL, !has_body) && has_body) {
+            conn_io->http3_posts.insert(s);
+        }
+        return;
+    }
 
+    if (has_body) {
+        quiche_conn_stream_shutdown(conn_io->conn, s, QUICHE_SHUTDOWN_READ, H3_NO_ERROR);
+    }
 
-    struct sockaddr_storage* peer_addr = (struct sockaddr_storage*) &addr;
-    socklen_t peer_addr_len = addr_len;
+    if (req.method != "GET") {
+        h3_respond(conn_io, s, "405", "0", true);
+        return;
+    }
 
+    const cached_content *content = content_cache_shard.find(req.path);
+    if (content == NULL) {
+        h3_respond(conn_io, s, "404", "0", true);
+        return;
+    }
 
-    sockaddr local_addr = dgram.get_dst().as_posix_sockaddr();
-    socklen_t local_addr_len = sizeof(local_addr);
+    bool empty = content->body.empty();
+    if (h3_respond(conn_io, s, "200", content->length.c_str(), empty) && !empty) {
+        queue_stream_data(conn_io, s, content->body.data(), content->body.size(), true, true);
+    }
+}
+
+// Echoes what has arrived of a POST body, up to STREAM_BACKLOG_LIMIT of
+// backlog. HTTP/3 reports new body data only once, so a stream that stops
+// early is marked and read again by flush_backlogs().
+static void h3_read_body(struct conn_io *conn_io, uint64_t s) {
+    auto it = conn_io->backlog.find(s);
+    size_t pending = it == conn_io->backlog.end() ? 0 : it->second.size();
+
+    while (pending < STREAM_BACKLOG_LIMIT) {
+        ssize_t len = quiche_h3_recv_body(conn_io->http3, conn_io->conn, s,
+                                          stream_scratch, sizeof(stream_scratch));
+        if (len <= 0) {
+            return;
+        }
+
+        pending = queue_stream_data(conn_io, s, stream_scratch, len, false);
+    }
+
+    conn_io->backlog[s].read_paused = true;
+}
+
+static void serve_http3(struct conn_io *conn_io) {
+    while (true) {
+        quiche_h3_event *ev;
+        int64_t s = quiche_h3_conn_poll(conn_io->http3, conn_io->conn, &ev);
+        if (s < 0) {
+            break;
+        }
+
+        switch (quiche_h3_event_type(ev)) {
+            case QUICHE_H3_EVENT_HEADERS:
+                h3_handle_request(conn_io, s, ev);
+                break;
+
+            case QUICHE_H3_EVENT_DATA:
+                if (conn_io->http3_posts.count(s)) {
+                    h3_read_body(conn_io, s);
+                }
+                break;
+
+            case QUICHE_H3_EVENT_FINISHED:
+                if (conn_io->http3_posts.erase(s)) {
+                    queue_stream_data(conn_io, s, (const uint8_t *) "", 0, true);
+                }
+                break;
+
+            case QUICHE_H3_EVENT_RESET: {
+                conn_io->http3_posts.erase(s);
+                auto it = conn_io->backlog.find(s);
+                if (it != conn_io->backlog.end()) {
+                    drop_backlog(conn_io, it);
+                }
+                break;
+            }
+
+            default:
+                break;
+        }
+
+        quiche_h3_event_free(ev);
+    }
+}
+
+// Copies `addr` into `out` whole, whatever its family; returns its length.
+static socklen_t to_sockaddr_storage(const socket_address &addr, struct sockaddr_storage *out) {
+    memset(out, 0, sizeof(*out));
+    memcpy(out, &addr.u.sa, addr.length());
+    return addr.length();
+}
+
+static void handle_connection(uint8_t *buf, ssize_t read, udp_channel &chan,
+                              const socket_address &src, const socket_address &dst) {
+    struct conn_io *conn_io = NULL;
+
+    static thread_local char out[MAX_DATAGRAM_SIZE];
+
+
+    // Retry tokens are bound to the peer's address, which has to be the
+    // whole of it for IPv6 too.
+    struct sockaddr_storage peer_storage;
+    struct sockaddr_storage *peer_addr = &peer_storage;
+    socklen_t peer_addr_len = to_sockaddr_storage(src, peer_addr);
+
+
+    struct sockaddr_storage local_addr;
+    socklen_t local_addr_len = to_sockaddr_storage(dst, &local_addr);
 
 
     uint8_t type;
@@ -116,17 +1313,39 @@ void handle_connection(uint8_t *buf, ssize_t read, udp_channel &chan, udp_datagr
     uint8_t odcid[QUICHE_MAX_CONN_ID_LEN];
     size_t odcid_len = sizeof(odcid);
 
-    uint8_t token[MAX_TOKEN_LEN];
+    uint8_t token[MAX_PARSED_TOKEN_LEN];
     size_t token_len = sizeof(token);
+    uint64_t started = stage_timing.start();
     int rc = quiche_header_info(buf, read, LOCAL_CONN_ID_LEN, &version,
                                 &type, scid, &scid_len, dcid, &dcid_len,
                                 token, &token_len);
+    uint64_t parsed = stage_timing.start();
     if (rc < 0) {
-        fprintf(stderr, "failed to parse header: %d\n", rc);
+        stage_timing.record(STAGE_HEADER_PARSE, started, parsed);
+        QLOG_DEBUG(server_log, "failed to parse header: {}", rc);
+        stats.header_errors++;
+        return;
+    }
+
+    // The owner parses the header again; only its parse is counted.
+    unsigned owner = owner_shard(dcid, dcid_len);
+    if (owner != seastar::this_shard_id()) {
+        forward_datagram(owner, buf, read, src, dst);
+        stage_timing.stop(STAGE_FORWARD, parsed);
         return;
     }
-    std::vector<uint8_t> map_key(dcid, dcid + dcid_len);
-    if (clients.find(map_key) == clients.end()) {
+    stage_timing.record(STAGE_HEADER_PARSE, started, parsed);
+
+    started = stage_timing.start();
+    if (dcid_len == LOCAL_CONN_ID_LEN) {
+        conn_io = clients.find(dcid);
+    }
+    if (conn_io == NULL) {
+        conn_io = find_pending(dcid, dcid_len);
+    }
+    stage_timing.stop(STAGE_CONN_LOOKUP, started);
+
+    if (conn_io == NULL) {
         if (!quiche_version_is_supported(version)) {
 
             ssize_t written = quiche_negotiate_version(scid, scid_len,
@@ -134,115 +1353,343 @@ void handle_connection(uint8_t *buf, ssize_t read, udp_channel &chan, udp_datagr
                                                        reinterpret_cast<uint8_t *>(out), sizeof(out));
 
             if (written < 0) {
-                fprintf(stderr, "failed to create vneg packet: %zd\n",
-                        written);
+                QLOG_LIMITED(server_log, seastar::log_level::warn,
+                             "failed to create vneg packet: {}", written);
                 return;
             }
 
-            (void) chan.send(dgram.get_src(), seastar::temporary_buffer<char>(out, written));
+            if (!egress->reserve(NULL, written)) {
+                stats.egress_drops++;
+                return;
+            }
+
+            stats.version_negotiations++;
+            stats.datagrams_sent++;
+            stats.bytes_sent += written;
+            egress->send(NULL, src, seastar::temporary_buffer<char>(out, written));
             return;
         }
 
-        if (token_len == 0) {
+        // Only an Initial can open a connection; anything else for an
+        // unknown connection ID is stale or forged.
+        if (type != QUIC_PACKET_TYPE_INITIAL) {
+            return;
+        }
 
+        // Dropping is the cheapest answer: nothing is decrypted or
+        // allocated, and the client retransmits its Initial later.
+        if (stats.handshakes_in_progress >= settings.max_handshakes) {
+            stats.handshakes_refused++;
+            QLOG_LIMITED(server_log, seastar::log_level::warn,
+                         "dropping Initial, {} handshakes in progress", stats.handshakes_in_progress);
+            return;
+        }
 
-            mint_token(dcid, dcid_len, peer_addr, peer_addr_len,
-                       token, &token_len);
+        uint8_t new_cid[LOCAL_CONN_ID_LEN];
+
+        // A token that doesn't validate is treated as absent (RFC 9000,
+        // section 8.1.3): the client may have it from another server, and
+        // dropping its Initial would leave it retrying the same token.
+        bool validated = false;
+        if (token_len != 0) {
+            validated = retry_keys.validate(token, token_len, peer_addr, dcid, dcid_len,
+                                            token_now_s(), odcid, &odcid_len);
+            if (!validated) {
+                QLOG_DEBUG(server_log, "invalid address validation token");
+                stats.invalid_tokens++;
+            }
+        }
 
-            uint8_t new_cid[LOCAL_CONN_ID_LEN];
+        if (!validated) {
+            uint64_t now = now_ms();
+            connection_attempts.add(now);
+
+            // While new clients arrive slowly, proving their address costs
+            // them a round trip for little gain. Above the threshold every
+            // client has to before it gets any state.
+            if (settings.retry_threshold == 0 ||
+                connection_attempts.rate(now) >= settings.retry_threshold) {
+                if (gen_cid(new_cid, LOCAL_CONN_ID_LEN, seastar::this_shard_id()) == NULL) {
+                    return;
+                }
+
+                if (!retry_keys.mint(dcid, dcid_len, peer_addr, new_cid, LOCAL_CONN_ID_LEN,
+                                     token_now_s(), token, &token_len)) {
+                    QLOG_LIMITED(server_log, seastar::log_level::warn, "failed to mint a retry token");
+                    return;
+                }
+
+                ssize_t written = quiche_retry(scid, scid_len,
+                                               dcid, dcid_len,
+                                               new_cid, LOCAL_CONN_ID_LEN,
+                                               token, token_len,
+                                               version, reinterpret_cast<uint8_t *>(out), sizeof(out));
+
+                if (written < 0) {
+                    QLOG_LIMITED(server_log, seastar::log_level::warn,
+                                 "failed to create retry packet: {}", written);
+                    return;
+                }
+
+                if (!egress->reserve(NULL, written)) {
+                    stats.egress_drops++;
+                    return;
+                }
+
+                stats.retries++;
+                stats.datagrams_sent++;
+                stats.bytes_sent += written;
+                egress->send(NULL, src, seastar::temporary_buffer<char>(out, written));
 
-            if (gen_cid(new_cid, LOCAL_CONN_ID_LEN) == NULL) {
                 return;
             }
 
-            ssize_t written = quiche_retry(scid, scid_len,
-                                           dcid, dcid_len,
-                                           new_cid, LOCAL_CONN_ID_LEN,
-                                           token, token_len,
-                                           version, reinterpret_cast<uint8_t *>(out), sizeof(out));
-
-            if (written < 0) {
-                fprintf(stderr, "failed to create retry packet: %zd\n",
-                        written);
+            // The connection ID the client picked is of its own choosing,
+            // the connection gets one of ours that encodes this shard.
+            if (gen_cid(new_cid, LOCAL_CONN_ID_LEN, seastar::this_shard_id()) == NULL) {
                 return;
             }
 
-            (void) chan.send(dgram.get_src(), seastar::temporary_buffer<char>(out, written));
-
-            return;
+            conn_io = create_conn(conn_pool, new_cid, LOCAL_CONN_ID_LEN, NULL, 0,
+                                  (struct sockaddr *) &local_addr, local_addr_len,
+                                  peer_addr, peer_addr_len, config);
+        } else {
+            conn_io = create_conn(conn_pool, dcid, dcid_len, odcid, odcid_len,
+                                  (struct sockaddr *) &local_addr, local_addr_len,
+                                  peer_addr, peer_addr_len, config);
         }
 
-
-        if (!validate_token(token, token_len, peer_addr, peer_addr_len,
-                            odcid, &odcid_len)) {
-            fprintf(stderr, "invalid address validation token\n");
+        if (conn_io == NULL) {
+            QLOG_LIMITED(server_log, seastar::log_level::warn, "failed to create connection");
             return;
         }
 
-        conn_io = create_conn(dcid, dcid_len, odcid, odcid_len,
-                              &local_addr, local_addr_len,
-                              peer_addr, peer_addr_len, config, clients);
+        conn_io->egress = seastar::make_lw_shared<egress_account>();
+        conn_io->egress->owner = conn_io;
 
-        if (conn_io == NULL) {
-            std::cout << "failed to create connection\n";
-            return;
+        clients.insert(conn_io->cid, conn_io);
+        stats.handshakes_in_progress++;
+
+        // The client keeps sending to its own connection ID until it has
+        // our first Initial, which may be lost.
+        if (!validated) {
+            stats.retries_skipped++;
+            memcpy(conn_io->odcid, dcid, dcid_len);
+            conn_io->odcid_len = dcid_len;
+            pending_odcids[odcid_key(dcid, dcid_len)] = conn_io;
         }
     }
-    else {
-        conn_io = clients[map_key];
-    }
     quiche_recv_info recv_info = {
             (struct sockaddr *) peer_addr,
             peer_addr_len,
             (struct sockaddr *) &local_addr,
             local_addr_len,
     };
+    started = stage_timing.start();
     ssize_t done = quiche_conn_recv(conn_io->conn, buf, read, &recv_info);
+    stage_timing.stop(STAGE_CONN_RECV, started);
     if (done < 0) {
-        fprintf(stderr, "failed to process packet: %zd\n", done);
+        QLOG_DEBUG(server_log, "failed to process packet: {}", done);
+        update_conn_timer(conn_io);
         return;
     }
 
 
-    if (quiche_conn_is_established(conn_io->conn)) {
-        uint64_t s = 0;
+    // A server is only in early data once it has accepted the client's
+    // 0-RTT packets, which takes a session ticket it could decrypt.
+    if (!conn_io->established && !conn_io->early_data && quiche_conn_is_in_early_data(conn_io->conn)) {
+        conn_io->early_data = true;
+        stats.early_data_accepted++;
+    }
 
-        quiche_stream_iter *readable = quiche_conn_readable(conn_io->conn);
+    if (!conn_io->established && quiche_conn_is_established(conn_io->conn)) {
+        conn_io->established = true;
+        stats.handshakes++;
+        stats.handshakes_in_progress--;
+        forget_odcid(conn_io);
+    }
 
-        while (quiche_stream_iter_next(readable, &s)) {
-            fprintf(stderr, "stream %" PRIu64 " is readable\n", s);
+    // Streams of a resumed session may carry 0-RTT data, which is served
+    // (and answered in 0.5-RTT packets) before the handshake completes.
+    if (conn_io->established || quiche_conn_is_in_early_data(conn_io->conn)) {
+        started = stage_timing.start();
+        if (http3_enabled && conn_io->http3 == NULL) {
+            conn_io->http3 = quiche_h3_accept(conn_io->conn, h3_config);
+            if (conn_io->http3 == NULL) {
+                QLOG_LIMITED(server_log, seastar::log_level::warn, "failed to create HTTP/3 connection");
+                quiche_conn_close(conn_io->conn, true, H3_INTERNAL_ERROR, (const uint8_t *) "", 0);
+            }
+        }
 
-            bool fin = false;
-            ssize_t recv_len = quiche_conn_stream_recv(conn_io->conn, s,
-                                                       buf, sizeof(buf),
-                                                       &fin);
+        if (dgram_enabled && !http3_enabled) {
+            echo_datagrams(conn_io);
+        }
 
-            if (recv_len < 0) {
-                break;
-            }
+        flush_backlogs(conn_io);
+        if (conn_io->http3 != NULL) {
+            serve_http3(conn_io);
+        } else if (!http3_enabled) {
+            echo_readable(conn_io);
+        }
+        stage_timing.stop(STAGE_APP, started);
+    }
 
+    schedule_send(conn_io);
+    update_conn_timer(conn_io);
+}
 
-            fprintf(stderr, "Received: %s\n", buf);
+seastar::future<> echo_server_run(const transport_settings &server_settings) {
+    settings = server_settings;
+    return f();
+}
 
-            quiche_conn_stream_send(conn_io->conn, s, buf, recv_len, false);
+static std::string cid_hex(const uint8_t *cid) {
+    static const char digits[] = "0123456789abcdef";
 
-            if (fin) {
-                static const char *resp = "Stream finished.\n";
-                quiche_conn_stream_send(conn_io->conn, s, (uint8_t *) resp,
-                                        5, true);
-            }
+    std::string hex;
+    for (size_t i = 0; i < LOCAL_CONN_ID_LEN; i++) {
+        hex += digits[cid[i] >> 4];
+        hex += digits[cid[i] & 0xf];
+    }
+    return hex;
+}
+
+std::vector<server_path_sample> echo_server_paths() {
+    std::vector<server_path_sample> paths;
+
+    clients.for_each([&paths](const uint8_t *cid, struct conn_io *conn_io) {
+        quiche_path_stats path_stats;
+        if (quiche_conn_path_stats(conn_io->conn, 0, &path_stats) == 0) {
+            paths.push_back(server_path_sample{cid_hex(cid), path_stats.rtt, path_stats.cwnd});
         }
+    });
 
-        quiche_stream_iter_free(readable);
-    }
+    return paths;
+}
 
-    send_data(conn_io, chan, dgram);
+server_packet_totals echo_server_packet_totals() {
+    conn_aggregate agg = aggregate_conns();
+    return server_packet_totals{stats.reaped_sent_packets + agg.sent_packets,
+                                stats.reaped_lost_packets + agg.lost_packets,
+                                stats.reaped_retrans_packets + agg.retrans_packets};
 }
 
+#ifndef QUICHE_ECHO_EMBEDDED
 int main(int argc, char **argv) {
     seastar::app_template app;
+
+    namespace po = boost::program_options;
+
+    app.add_options()
+            ("port", po::value<uint16_t>()->default_value(1234),
+             "UDP port to listen on")
+            ("cert", po::value<std::string>()->default_value("./cert.crt"),
+             "certificate chain, PEM")
+            ("key", po::value<std::string>()->default_value("./cert.key"),
+             "private key, PEM")
+            ("cc", po::value<std::string>()->default_value("reno"),
+             "congestion control algorithm: reno, cubic or bbr")
+            ("hystart", po::value<bool>()->default_value(true),
+             "use HyStart++ in slow start")
+            ("pacing", po::value<bool>()->default_value(true),
+             "release packets at the times quiche paces them to (also toggles quiche's pacing)")
+            ("early-data", po::value<bool>()->default_value(true),
+             "accept 0-RTT data from resuming clients (saves a round trip only with a non-zero --retry-threshold)")
+            ("idle-timeout", po::value<uint64_t>()->default_value(5000),
+             "idle timeout in milliseconds")
+            ("max-payload-size", po::value<size_t>()->default_value(MAX_DATAGRAM_SIZE),
+             "largest UDP payload sent or accepted, in bytes")
+            ("max-data", po::value<uint64_t>()->default_value(10000000),
+             "initial connection flow control window, in bytes")
+            ("max-stream-data", po::value<uint64_t>()->default_value(1000000),
+             "initial per-stream flow control window, in bytes")
+            ("max-connection-window", po::value<uint64_t>()->default_value(0),
+             "upper bound the connection window may grow to, 0 for quiche's default")
+            ("max-stream-window", po::value<uint64_t>()->default_value(0),
+             "upper bound a stream window may grow to, 0 for quiche's default")
+            ("max-streams-bidi", po::value<uint64_t>()->default_value(100),
+             "bidirectional streams a peer may open")
+            ("max-streams-uni", po::value<uint64_t>()->default_value(100),
+             "unidirectional streams a peer may open")
+            ("max-ack-delay", po::value<uint64_t>()->default_value(25),
+             "max_ack_delay transport parameter, in milliseconds")
+            ("retry-threshold", po::value<uint64_t>()->default_value(0),
+             "new connections per second and shard from which clients must answer a Retry, 0 to always send one "
+             "(which costs resuming clients the round trip 0-RTT would save)")
+            ("max-handshakes", po::value<uint64_t>()->default_value(4096),
+             "handshakes in progress per shard before new connections are dropped")
+            ("egress-limit", po::value<size_t>()->default_value(64 << 20),
+             "bytes of outgoing datagrams a shard may have waiting for the socket")
+            ("conn-egress-limit", po::value<size_t>()->default_value(1 << 20),
+             "bytes of outgoing datagrams a connection may have waiting for the socket")
+            ("prometheus-port", po::value<uint16_t>()->default_value(9180),
+             "port of the Prometheus metrics endpoint, 0 to disable it")
+            ("http3", po::value<bool>()->default_value(false),
+             "speak HTTP/3 instead of echoing raw streams")
+            ("content-dir", po::value<std::string>()->default_value(""),
+             "directory whose files are served to HTTP/3 GET requests")
+            ("dgram", po::value<bool>()->default_value(false),
+             "accept DATAGRAM frames and echo them back (raw stream mode only)")
+            ("ingress-batch", po::value<unsigned>()->default_value(32),
+             "most messages per recvmmsg (at most 64), or datagrams per wakeup with --gso=false")
+            ("gso", po::value<bool>()->default_value(true),
+             "serve from a socket of the server's own and send bursts with UDP GSO (sendmmsg where unsupported)")
+            ("stage-timing", po::value<bool>()->default_value(false),
+             "time the stages of the packet path (SIGUSR2 toggles it, SIGUSR1 logs the timings)");
+
     try {
-        app.run(argc, argv, f);
+        app.run(argc, argv, [&app] {
+            auto &&opts = app.configuration();
+
+            settings.port = opts["port"].as<uint16_t>();
+            settings.cert = opts["cert"].as<std::string>();
+            settings.key = opts["key"].as<std::string>();
+            settings.hystart = opts["hystart"].as<bool>();
+            settings.pacing = opts["pacing"].as<bool>();
+            settings.early_data = opts["early-data"].as<bool>();
+            settings.idle_timeout_ms = opts["idle-timeout"].as<uint64_t>();
+            settings.max_payload = opts["max-payload-size"].as<size_t>();
+            settings.max_data = opts["max-data"].as<uint64_t>();
+            settings.max_stream_data = opts["max-stream-data"].as<uint64_t>();
+            settings.max_connection_window = opts["max-connection-window"].as<uint64_t>();
+            settings.max_stream_window = opts["max-stream-window"].as<uint64_t>();
+            settings.max_streams_bidi = opts["max-streams-bidi"].as<uint64_t>();
+            settings.max_streams_uni = opts["max-streams-uni"].as<uint64_t>();
+            settings.max_ack_delay_ms = opts["max-ack-delay"].as<uint64_t>();
+            settings.retry_threshold = opts["retry-threshold"].as<uint64_t>();
+            settings.max_handshakes = opts["max-handshakes"].as<uint64_t>();
+            settings.egress_limit = opts["egress-limit"].as<size_t>();
+            settings.conn_egress_limit = opts["conn-egress-limit"].as<size_t>();
+
+            if (!parse_cc_algorithm(opts["cc"].as<std::string>(), &settings.cc)) {
+                server_log.error("unknown congestion control algorithm {}", opts["cc"].as<std::string>());
+                return seastar::make_ready_future<>();
+            }
+            // QUIC requires 1200 bytes; larger payloads than one UDP
+            // datagram can carry make no sense.
+            if (settings.max_payload < 1200 || settings.max_payload > MAX_UDP_PAYLOAD) {
+                server_log.error("--max-payload-size must be between 1200 and {}", MAX_UDP_PAYLOAD);
+                return seastar::make_ready_future<>();
+            }
+            // Sending resumes once a quarter of the shard budget is free,
+            // which has to fit a whole burst.
+            if (settings.egress_limit < 4 * MAX_SEND_BATCH_SIZE) {
+                server_log.error("--egress-limit must be at least {}", 4 * MAX_SEND_BATCH_SIZE);
+                return seastar::make_ready_future<>();
+            }
+
+            prometheus_port = opts["prometheus-port"].as<uint16_t>();
+            http3_enabled = opts["http3"].as<bool>();
+            content_dir = opts["content-dir"].as<std::string>();
+            dgram_enabled = opts["dgram"].as<bool>();
+            gso_enabled = opts["gso"].as<bool>();
+            ingress_batch = std::max(opts["ingress-batch"].as<unsigned>(), 1u);
+            stage_timing_on = opts["stage-timing"].as<bool>();
+
+            return start_prometheus().then([] {
+                return f();
+            });
+        });
     } catch (...) {
         std::cerr << "Couldn't start application: "
                   << std::current_exception() << "\n";
@@ -250,3 +1697,4 @@ int main(int argc, char **argv) {
     }
     return 0;
 }
+#endif
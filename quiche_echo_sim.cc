@@ -0,0 +1,349 @@
+// Runs the echo server and the load client against each other in one
+// process, over a simulated network instead of sockets. Every shard gets
+// its own network, server socket and load connections, so the link
+// parameters apply per shard. Server and client share the shard's CPU,
+// which makes absolute throughput lower than over two processes but keeps
+// runs comparable with each other: the point is benchmarking congestion
+// control, pacing and window sizes under a given delay, bandwidth and loss
+// without a network.
+//
+// With --output, the run is also appended to a file as one JSON object per
+// line: its parameters, goodput, request latency, the server's smoothed
+// RTT percentiles and retransmission rate, and a trace of every server
+// connection's RTT and congestion window sampled each --sample-interval.
+
+#include <seastar/core/app-template.hh>
+#include <seastar/core/future-util.hh>
+#include <seastar/core/reactor.hh>
+#include <seastar/core/sleep.hh>
+#include <seastar/core/smp.hh>
+#include <seastar/util/log.hh>
+#include <boost/range/irange.hpp>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "quiche_utils.h"
+#include "quiche_load.h"
+#include "quiche_histogram.h"
+#include "quiche_sim_net.h"
+#include "quiche_embed.h"
+
+static seastar::logger sim_log("echo_sim");
+
+// A run as described on the command line, written to --output with its
+// results.
+struct sim_run {
+    std::string profile;
+    std::string workload;
+    std::string cc;
+    link_params link;
+    uint64_t seed = 0;
+    transport_settings server;
+    load_options load;
+    std::chrono::milliseconds sample_interval{100};
+};
+
+struct trace_point {
+    double t;
+    unsigned shard;
+    server_path_sample path;
+};
+
+// Server path samples taken while the load runs, on shard 0.
+static std::vector<trace_point> trace;
+static bool sampling = false;
+
+// Networks are never freed: sockets of the server and the client point to
+// them until the process exits.
+static seastar::future<> start_networks(uint16_t server_port, link_params to_server,
+                                        link_params from_server, uint64_t seed) {
+    return seastar::smp::invoke_on_all([=] {
+        shard_sim_network = new sim_network(server_port, to_server, from_server,
+                                            seed + seastar::this_shard_id());
+    });
+}
+
+static void print_link(const char *name, const link_stats &s) {
+    double dropped = s.packets ? 100.0 * (s.lost + s.queue_drops) / s.packets : 0;
+    printf("%s: %" PRIu64 " datagrams, %" PRIu64 " bytes, %" PRIu64 " lost, %" PRIu64 " queue drops (%.2f%%), "
+           "%" PRIu64 " reordered, %" PRIu64 " duplicated\n",
+           name, s.packets, s.bytes, s.lost, s.queue_drops, dropped, s.reordered, s.duplicated);
+}
+
+static seastar::future<> print_links() {
+    auto cores = boost::irange<unsigned>(0, seastar::smp::count);
+
+    return seastar::map_reduce(cores.begin(), cores.end(),
+                               [](unsigned core) {
+                                   return seastar::smp::submit_to(core, [] {
+                                       return std::make_pair(shard_sim_network->to_server_stats(),
+                                                             shard_sim_network->from_server_stats());
+                                   });
+                               },
+                               std::make_pair(link_stats(), link_stats()),
+                               [](auto total, auto shard) {
+                                   total.first.merge(shard.first);
+                                   total.second.merge(shard.second);
+                                   return total;
+                               }).then([](auto total) {
+        print_link("client -> server", total.first);
+        print_link("server -> client", total.second);
+    });
+}
+
+static uint64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            seastar::steady_clock_type::now().time_since_epoch()).count();
+}
+
+static seastar::future<> sample_paths(uint64_t start_ns) {
+    return seastar::parallel_for_each(boost::irange<unsigned>(0, seastar::smp::count), [start_ns](unsigned core) {
+        return seastar::smp::submit_to(core, [] {
+            return echo_server_paths();
+        }).then([start_ns, core](std::vector<server_path_sample> paths) {
+            double t = (now_ns() - start_ns) / 1e9;
+            for (auto &path : paths) {
+                trace.push_back(trace_point{t, core, std::move(path)});
+            }
+        });
+    });
+}
+
+static seastar::future<> sample_loop(std::chrono::milliseconds interval) {
+    uint64_t start_ns = now_ns();
+
+    return seastar::do_until([] { return !sampling; }, [interval, start_ns] {
+        return seastar::sleep(interval).then([start_ns] {
+            return sampling ? sample_paths(start_ns) : seastar::make_ready_future<>();
+        });
+    });
+}
+
+static seastar::future<server_packet_totals> packet_totals() {
+    auto cores = boost::irange<unsigned>(0, seastar::smp::count);
+
+    return seastar::map_reduce(cores.begin(), cores.end(),
+                               [](unsigned core) {
+                                   return seastar::smp::submit_to(core, echo_server_packet_totals);
+                               },
+                               server_packet_totals{0, 0, 0},
+                               [](server_packet_totals total, server_packet_totals shard) {
+                                   total.sent += shard.sent;
+                                   total.lost += shard.lost;
+                                   total.retrans += shard.retrans;
+                                   return total;
+                               });
+}
+
+static std::string json_string(const std::string &s) {
+    std::string out = "\"";
+    for (char c : s) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+        }
+        out += c;
+    }
+    return out + "\"";
+}
+
+// Appends the run as one line of JSON.
+static bool write_result(const std::string &path, const sim_run &run, const load_result &result,
+                         const server_packet_totals &packets) {
+    FILE *out = fopen(path.c_str(), "a");
+    if (out == NULL) {
+        return false;
+    }
+
+    log_histogram rtt;
+    for (const auto &point : trace) {
+        rtt.record(point.path.rtt_ns);
+    }
+
+    double seconds = result.seconds > 0 ? result.seconds : 1;
+    const link_params &link = run.link;
+
+    fprintf(out, "{\"profile\":%s,\"workload\":%s,\"cc\":%s,\"hystart\":%s,\"pacing\":%s,",
+            json_string(run.profile).c_str(), json_string(run.workload).c_str(), json_string(run.cc).c_str(),
+            run.server.hystart ? "true" : "false", run.server.pacing ? "true" : "false");
+    fprintf(out, "\"link\":{\"delay_ms\":%.3f,\"jitter_ms\":%.3f,\"bandwidth_bps\":%" PRIu64 ",\"queue_bytes\":%zu,"
+                 "\"loss\":%g,\"loss_burst\":%g,\"reorder\":%g,\"duplicate\":%g,\"seed\":%" PRIu64 "},",
+            link.delay.count() / 1e3, link.jitter.count() / 1e3, link.rate_bps, link.queue_bytes,
+            link.loss, link.loss_burst, link.reorder, link.duplicate, run.seed);
+    fprintf(out, "\"load\":{\"shards\":%u,\"connections\":%u,\"streams\":%u,\"payload_min\":%zu,"
+                 "\"payload_max\":%zu,\"rate\":%g,\"duration_s\":%lld},",
+            seastar::smp::count, run.load.connections, run.load.streams, run.load.payload_min,
+            run.load.payload_max, run.load.rate, (long long) run.load.duration.count());
+    fprintf(out, "\"results\":{\"seconds\":%.3f,\"requests\":%" PRIu64 ",\"incomplete\":%" PRIu64 ","
+                 "\"failed_connections\":%" PRIu64 ",\"goodput_bps\":%.0f,\"requests_per_s\":%.1f,"
+                 "\"latency_p50_us\":%.1f,\"latency_p99_us\":%.1f,\"rtt_p50_us\":%.1f,\"rtt_p99_us\":%.1f,"
+                 "\"packets_sent\":%" PRIu64 ",\"packets_lost\":%" PRIu64 ",\"packets_retransmitted\":%" PRIu64 ","
+                 "\"retransmission_rate\":%.5f},",
+            result.seconds, result.completed, result.incomplete, result.failed_connections,
+            result.bytes * 8 / seconds, result.completed / seconds,
+            result.latency.quantile(0.5) / 1e3, result.latency.quantile(0.99) / 1e3,
+            rtt.quantile(0.5) / 1e3, rtt.quantile(0.99) / 1e3,
+            packets.sent, packets.lost, packets.retrans,
+            packets.sent ? (double) packets.retrans / packets.sent : 0);
+
+    // [seconds since start, shard, connection ID, smoothed RTT in us, cwnd]
+    fprintf(out, "\"trace\":[");
+    for (size_t i = 0; i < trace.size(); i++) {
+        const trace_point &point = trace[i];
+        fprintf(out, "%s[%.3f,%u,\"%s\",%.1f,%" PRIu64 "]", i ? "," : "", point.t, point.shard,
+                point.path.cid.c_str(), point.path.rtt_ns / 1e3, point.path.cwnd);
+    }
+    fprintf(out, "]}\n");
+
+    return fclose(out) == 0;
+}
+
+static double percent(double p) {
+    return std::clamp(p, 0.0, 100.0) / 100;
+}
+
+int main(int argc, char **argv) {
+    seastar::app_template app;
+
+    namespace po = boost::program_options;
+
+    app.add_options()
+            ("delay", po::value<double>()->default_value(10),
+             "one-way delay in milliseconds")
+            ("jitter", po::value<double>()->default_value(0),
+             "extra one-way delay of up to this many milliseconds, uniformly distributed")
+            ("bandwidth", po::value<double>()->default_value(0),
+             "bottleneck rate per direction in Mbit/s, 0 for none")
+            ("queue", po::value<size_t>()->default_value(256 * 1024),
+             "bytes that may wait for the bottleneck before it drops")
+            ("loss", po::value<double>()->default_value(0),
+             "loss rate in percent")
+            ("loss-burst", po::value<double>()->default_value(1),
+             "mean length of loss bursts in datagrams, 1 for independent losses")
+            ("reorder", po::value<double>()->default_value(0),
+             "percentage of datagrams that skip the delay and overtake earlier ones")
+            ("duplicate", po::value<double>()->default_value(0),
+             "percentage of datagrams delivered twice")
+            ("seed", po::value<uint64_t>()->default_value(1),
+             "seed of the network's random decisions (shard N uses seed + N); printed with the results")
+            ("cc", po::value<std::string>()->default_value("reno"),
+             "server congestion control algorithm: reno, cubic or bbr")
+            ("hystart", po::value<bool>()->default_value(true),
+             "server uses HyStart++ in slow start")
+            ("pacing", po::value<bool>()->default_value(true),
+             "server paces its packets")
+            ("max-data", po::value<uint64_t>()->default_value(10000000),
+             "server's initial connection flow control window, in bytes")
+            ("max-stream-data", po::value<uint64_t>()->default_value(1000000),
+             "server's initial per-stream flow control window, in bytes")
+            ("max-connection-window", po::value<uint64_t>()->default_value(0),
+             "upper bound the server's connection window may grow to, 0 for quiche's default")
+            ("max-stream-window", po::value<uint64_t>()->default_value(0),
+             "upper bound the server's stream windows may grow to, 0 for quiche's default")
+            ("connections", po::value<unsigned>()->default_value(1),
+             "load connections per shard")
+            ("streams", po::value<unsigned>()->default_value(1),
+             "concurrent requests per connection (closed loop)")
+            ("payload-size", po::value<std::string>()->default_value("1024"),
+             "request payload size in bytes, N or MIN-MAX for a uniform distribution")
+            ("rate", po::value<double>()->default_value(0),
+             "requests per second per shard (open loop), 0 for closed loop")
+            ("duration", po::value<unsigned>()->default_value(10),
+             "test duration in seconds")
+            ("output", po::value<std::string>()->default_value(""),
+             "append the run's parameters, results and path traces to this file, as a line of JSON")
+            ("sample-interval", po::value<unsigned>()->default_value(100),
+             "milliseconds between samples of the server's RTT and congestion windows")
+            ("profile", po::value<std::string>()->default_value(""),
+             "name of the link profile, copied to --output")
+            ("workload", po::value<std::string>()->default_value(""),
+             "name of the workload, copied to --output");
+
+    try {
+        app.run(argc, argv, [&app] {
+            auto &&opts = app.configuration();
+
+            link_params link;
+            link.delay = std::chrono::microseconds((int64_t) (opts["delay"].as<double>() * 1000));
+            link.jitter = std::chrono::microseconds((int64_t) (opts["jitter"].as<double>() * 1000));
+            link.rate_bps = (uint64_t) (opts["bandwidth"].as<double>() * 1e6);
+            link.queue_bytes = opts["queue"].as<size_t>();
+            link.loss = percent(opts["loss"].as<double>());
+            link.loss_burst = opts["loss-burst"].as<double>();
+            link.reorder = percent(opts["reorder"].as<double>());
+            link.duplicate = percent(opts["duplicate"].as<double>());
+            if (link.loss >= 1) {
+                sim_log.error("--loss must be below 100");
+                return seastar::make_ready_future<>();
+            }
+
+            transport_settings server;
+            server.hystart = opts["hystart"].as<bool>();
+            server.pacing = opts["pacing"].as<bool>();
+            server.max_data = opts["max-data"].as<uint64_t>();
+            server.max_stream_data = opts["max-stream-data"].as<uint64_t>();
+            server.max_connection_window = opts["max-connection-window"].as<uint64_t>();
+            server.max_stream_window = opts["max-stream-window"].as<uint64_t>();
+            if (!parse_cc_algorithm(opts["cc"].as<std::string>(), &server.cc)) {
+                sim_log.error("unknown congestion control algorithm {}", opts["cc"].as<std::string>());
+                return seastar::make_ready_future<>();
+            }
+
+            load_options load;
+            load.connections = std::max(opts["connections"].as<unsigned>(), 1u);
+            load.streams = std::max(opts["streams"].as<unsigned>(), 1u);
+            load.rate = opts["rate"].as<double>();
+            load.duration = std::chrono::seconds(opts["duration"].as<unsigned>());
+            if (!parse_payload_size(opts["payload-size"].as<std::string>(), load.payload_min, load.payload_max)) {
+                sim_log.error("invalid --payload-size");
+                return seastar::make_ready_future<>();
+            }
+
+            sim_run run;
+            run.profile = opts["profile"].as<std::string>();
+            run.workload = opts["workload"].as<std::string>();
+            run.cc = opts["cc"].as<std::string>();
+            run.link = link;
+            run.seed = opts["seed"].as<uint64_t>();
+            run.server = server;
+            run.load = load;
+            run.sample_interval = std::chrono::milliseconds(std::max(opts["sample-interval"].as<unsigned>(), 1u));
+            std::string output = opts["output"].as<std::string>();
+
+            return start_networks(server.port, link, link, run.seed).then([server] {
+                // Runs for as long as the process does.
+                (void) echo_server_run(server);
+
+                // The server binds its sockets on the other shards
+                // asynchronously; datagrams sent before would be lost.
+                return seastar::sleep(std::chrono::milliseconds(100));
+            }).then([run] {
+                sampling = true;
+                auto sampled = sample_loop(run.sample_interval);
+
+                return echo_load_run(run.load).then([sampled = std::move(sampled)](load_result result) mutable {
+                    sampling = false;
+                    return sampled.then([result = std::move(result)]() mutable {
+                        return std::move(result);
+                    });
+                });
+            }).then([run, output](load_result result) {
+                return packet_totals().then([run, output, result = std::move(result)](server_packet_totals packets) {
+                    if (!output.empty() && !write_result(output, run, result, packets)) {
+                        sim_log.error("failed to write {}: {}", output, strerror(errno));
+                    }
+                    printf("seed: %" PRIu64 "\n", run.seed);
+                    return print_links();
+                });
+            });
+        });
+    } catch (...) {
+        std::cerr << "Couldn't start application: " << std::current_exception() << "\n";
+        return 1;
+    }
+    return 0;
+}
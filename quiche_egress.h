@@ -0,0 +1,180 @@
+#ifndef SEASTAR_QUICHE_EGRESS_H
+#define SEASTAR_QUICHE_EGRESS_H
+
+#include <seastar/core/future.hh>
+#include <seastar/core/semaphore.hh>
+#include <seastar/core/shared_ptr.hh>
+#include <seastar/core/temporary_buffer.hh>
+#include <seastar/net/api.hh>
+#include "quiche_udp_socket.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// Bytes of one connection's datagrams handed out for sending and not yet
+// taken by the kernel. Sends still in flight keep it alive after the
+// connection is gone.
+struct egress_account {
+    size_t in_flight = 0;
+    // Set when the connection stopped sending at its limit; it's woken once
+    // half of that has drained.
+    bool blocked = false;
+    // NULL once the connection is gone.
+    void *owner = NULL;
+};
+
+// Consecutive datagrams of one connection to one destination, all of the
+// first one's size except possibly the last, so they can go out as one GSO
+// send.
+struct segment_run {
+    seastar::lw_shared_ptr<egress_account> acct;
+    seastar::socket_address dst;
+    std::vector<seastar::temporary_buffer<char>> segs;
+
+    // Whether a datagram of `size` bytes for `a` and `d` may join the run.
+    bool fits(const egress_account *a, const seastar::socket_address &d, size_t size) const {
+        return segs.empty() ||
+               (a == acct.get() && d == dst && segs.back().size() == segs.front().size() &&
+                size <= segs.front().size());
+    }
+
+    void add(seastar::lw_shared_ptr<egress_account> a, const seastar::socket_address &d,
+             seastar::temporary_buffer<char> data) {
+        if (segs.empty()) {
+            acct = std::move(a);
+            dst = d;
+        }
+        segs.push_back(std::move(data));
+    }
+};
+
+// Bounds the memory held by datagrams passed to udp_channel::send() (or
+// queued for it) and not yet sent, per shard and per connection. Bytes are
+// reserved before a datagram is built and returned when its send completes,
+// successfully or not. One instance per shard.
+class egress_limiter {
+public:
+    // Called with the owner of an account that drained below its limit, or
+    // with NULL once the shard budget has room again after running out.
+    using wake_fn = void (*)(void *owner);
+
+private:
+    seastar::net::udp_channel &_chan;
+    // The channel's implementation if it takes segment runs, else NULL.
+    udp_socket_channel *_bursts;
+    seastar::semaphore _bytes;
+    size_t _limit;
+    size_t _conn_limit;
+    wake_fn _wake;
+    bool _stalled = false;
+    uint64_t _failures = 0;
+
+    void release(egress_account *acct, size_t n) {
+        _bytes.signal(n);
+
+        if (acct != NULL) {
+            acct->in_flight -= n;
+            if (acct->blocked && acct->in_flight <= _conn_limit / 2) {
+                acct->blocked = false;
+                if (acct->owner != NULL) {
+                    _wake(acct->owner);
+                }
+            }
+        }
+
+        if (_stalled && _bytes.available_units() >= (ssize_t) (_limit / 4)) {
+            _stalled = false;
+            _wake(NULL);
+        }
+    }
+
+public:
+    egress_limiter(seastar::net::udp_channel &chan, udp_socket_channel *bursts,
+                   size_t limit, size_t conn_limit, wake_fn wake)
+            : _chan(chan), _bursts(bursts), _bytes(limit), _limit(limit), _conn_limit(conn_limit), _wake(wake) {
+    }
+
+    // In-flight sends point back here.
+    egress_limiter(const egress_limiter &) = delete;
+    egress_limiter &operator=(const egress_limiter &) = delete;
+
+    // Reserves `n` bytes for a connection, or for a packet not tied to one
+    // if `acct` is NULL. An idle connection may always reserve, so a limit
+    // below `n` can't wedge it.
+    bool reserve(egress_account *acct, size_t n) {
+        if (acct != NULL && acct->in_flight > 0 && acct->in_flight + n > _conn_limit) {
+            acct->blocked = true;
+            return false;
+        }
+
+        if (!_bytes.try_wait(n)) {
+            _stalled = true;
+            return false;
+        }
+
+        if (acct != NULL) {
+            acct->in_flight += n;
+        }
+        return true;
+    }
+
+    // Returns reserved bytes that weren't used.
+    void unreserve(egress_account *acct, size_t n) {
+        if (n > 0) {
+            release(acct, n);
+        }
+    }
+
+    // Sends a datagram whose size was reserved against `acct`.
+    void send(seastar::lw_shared_ptr<egress_account> acct, const seastar::socket_address &dst,
+              seastar::temporary_buffer<char> data) {
+        size_t n = data.size();
+        (void) _chan.send(dst, std::move(data)).then_wrapped([this, acct = std::move(acct), n](seastar::future<> f) {
+            if (f.failed()) {
+                f.ignore_ready_future();
+                _failures++;
+            }
+            release(acct.get(), n);
+        });
+    }
+
+    // Sends the datagrams of `run`, reserved against its account, in one
+    // go where the channel can; leaves the run empty.
+    void send(segment_run &run) {
+        if (_bursts == NULL || run.segs.size() <= 1) {
+            for (auto &seg : run.segs) {
+                send(run.acct, run.dst, std::move(seg));
+            }
+        } else {
+            size_t n = 0;
+            for (auto &seg : run.segs) {
+                n += seg.size();
+            }
+            (void) _bursts->send_segments(run.dst, std::move(run.segs)).then_wrapped(
+                    [this, acct = run.acct, n](seastar::future<> f) {
+                if (f.failed()) {
+                    f.ignore_ready_future();
+                    _failures++;
+                }
+                release(acct.get(), n);
+            });
+        }
+
+        run.segs.clear();
+        run.acct = nullptr;
+    }
+
+    bool stalled() const {
+        return _stalled;
+    }
+
+    size_t in_flight() const {
+        return _limit - _bytes.available_units();
+    }
+
+    uint64_t failures() const {
+        return _failures;
+    }
+};
+
+#endif //SEASTAR_QUICHE_EGRESS_H
@@ -0,0 +1,42 @@
+#ifndef SEASTAR_QUICHE_EMBED_H
+#define SEASTAR_QUICHE_EMBED_H
+
+#include <seastar/core/future.hh>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "quiche_utils.h"
+#include "quiche_load.h"
+
+// Entry points of the server and the load client for binaries linking both
+// of them (built with QUICHE_ECHO_EMBEDDED, which leaves out their main()).
+// echo_server_run and echo_load_run are called on shard 0 after the reactor
+// started.
+
+// Starts the echo server on every shard; resolves only if it fails to.
+seastar::future<> echo_server_run(const transport_settings &settings);
+
+// The primary path of a server connection.
+struct server_path_sample {
+    // Connection ID, hex.
+    std::string cid;
+    // Smoothed RTT in nanoseconds.
+    uint64_t rtt_ns;
+    uint64_t cwnd;
+};
+
+// Packets the server sent so far, on live and closed connections.
+struct server_packet_totals {
+    uint64_t sent;
+    uint64_t lost;
+    uint64_t retrans;
+};
+
+// The server's connections on the calling shard.
+std::vector<server_path_sample> echo_server_paths();
+server_packet_totals echo_server_packet_totals();
+
+// Runs a load test on every shard, prints and returns its results.
+seastar::future<load_result> echo_load_run(const load_options &opts);
+
+#endif //SEASTAR_QUICHE_EMBED_H
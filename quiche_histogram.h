@@ -0,0 +1,114 @@
+#ifndef SEASTAR_QUICHE_HISTOGRAM_H
+#define SEASTAR_QUICHE_HISTOGRAM_H
+
+#include <stdint.h>
+#include <math.h>
+#include <array>
+
+// Sub-buckets per power of two; 2^5 keeps the relative error under ~3%.
+#define HISTOGRAM_SUB_BITS 5
+#define HISTOGRAM_SUB_BUCKETS (1u << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+// Log-linear (HDR style) histogram of 64 bit values, e.g. nanoseconds.
+// Values below 2 * HISTOGRAM_SUB_BUCKETS are counted exactly, every power of
+// two above is split into HISTOGRAM_SUB_BUCKETS equal buckets. Recording is
+// a couple of shifts and an increment; histograms of different shards are
+// merged by adding them up.
+class log_histogram {
+    std::array<uint64_t, HISTOGRAM_BUCKETS> _buckets{};
+    uint64_t _count = 0;
+    uint64_t _sum = 0;
+    uint64_t _max = 0;
+
+public:
+    static unsigned bucket_of(uint64_t v) {
+        if (v < 2 * HISTOGRAM_SUB_BUCKETS) {
+            return (unsigned) v;
+        }
+
+        unsigned shift = 63 - __builtin_clzll(v) - HISTOGRAM_SUB_BITS;
+        return shift * HISTOGRAM_SUB_BUCKETS + (unsigned) (v >> shift);
+    }
+
+    // Largest value counted in bucket `b`.
+    static uint64_t bucket_high(unsigned b) {
+        if (b < 2 * HISTOGRAM_SUB_BUCKETS) {
+            return b;
+        }
+
+        unsigned shift = b / HISTOGRAM_SUB_BUCKETS - 1;
+        uint64_t mantissa = b % HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BUCKETS;
+        return ((mantissa + 1) << shift) - 1;
+    }
+
+    void record(uint64_t v) {
+        _buckets[bucket_of(v)]++;
+        _count++;
+        _sum += v;
+        if (v > _max) {
+            _max = v;
+        }
+    }
+
+    void merge(const log_histogram &other) {
+        for (unsigned b = 0; b < HISTOGRAM_BUCKETS; b++) {
+            _buckets[b] += other._buckets[b];
+        }
+        _count += other._count;
+        _sum += other._sum;
+        if (other._max > _max) {
+            _max = other._max;
+        }
+    }
+
+    void reset() {
+        *this = log_histogram();
+    }
+
+    uint64_t count() const {
+        return _count;
+    }
+
+    uint64_t sum() const {
+        return _sum;
+    }
+
+    uint64_t max() const {
+        return _max;
+    }
+
+    uint64_t bucket_count(unsigned b) const {
+        return _buckets[b];
+    }
+
+    double mean() const {
+        return _count ? (double) _sum / _count : 0;
+    }
+
+    // Value at or below which a fraction `q` (0..1] of the samples lie,
+    // reported as the upper edge of its bucket.
+    uint64_t quantile(double q) const {
+        if (_count == 0) {
+            return 0;
+        }
+
+        uint64_t rank = (uint64_t) ceil(q * _count);
+        if (rank == 0) {
+            rank = 1;
+        }
+
+        uint64_t seen = 0;
+        for (unsigned b = 0; b < HISTOGRAM_BUCKETS; b++) {
+            seen += _buckets[b];
+            if (seen >= rank) {
+                uint64_t high = bucket_high(b);
+                return high < _max ? high : _max;
+            }
+        }
+
+        return _max;
+    }
+};
+
+#endif //SEASTAR_QUICHE_HISTOGRAM_H
@@ -0,0 +1,78 @@
+#ifndef SEASTAR_QUICHE_LOAD_H
+#define SEASTAR_QUICHE_LOAD_H
+
+#include "quiche_histogram.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+
+// Parameters of a load test run by echo_client (see quiche_echo_client.cc).
+struct load_options {
+    unsigned connections = 0;
+    unsigned streams = 1;
+    size_t payload_min = 1024;
+    size_t payload_max = 1024;
+    // Requests per second per shard, 0 for closed loop.
+    double rate = 0;
+    std::chrono::seconds duration{10};
+    bool dgram = false;
+    unsigned requests_per_connection = 0;
+    bool resume = true;
+};
+
+// What a load test measured; shards' results are merged into one.
+struct load_result {
+    log_histogram latency;
+    // DATAGRAM mode: client to server and server to client delays.
+    log_histogram one_way_up;
+    log_histogram one_way_down;
+    uint64_t dgrams_lost = 0;
+    // Reconnects: handshakes without a session and handshakes that offered
+    // 0-RTT early data, and time from connecting to the first completed
+    // request for each. An offer is not a resumption: whether the server
+    // took the early data is only known to the server, which counts it in
+    // quic_early_data_accepted.
+    uint64_t handshakes_no_session = 0;
+    uint64_t handshakes_offered_0rtt = 0;
+    log_histogram first_echo_no_session;
+    log_histogram first_echo_offered_0rtt;
+    uint64_t completed = 0;
+    uint64_t incomplete = 0;
+    uint64_t bytes = 0;
+    uint64_t failed_connections = 0;
+    double seconds = 0;
+
+    load_result &merge(const load_result &other) {
+        latency.merge(other.latency);
+        one_way_up.merge(other.one_way_up);
+        one_way_down.merge(other.one_way_down);
+        dgrams_lost += other.dgrams_lost;
+        handshakes_no_session += other.handshakes_no_session;
+        handshakes_offered_0rtt += other.handshakes_offered_0rtt;
+        first_echo_no_session.merge(other.first_echo_no_session);
+        first_echo_offered_0rtt.merge(other.first_echo_offered_0rtt);
+        completed += other.completed;
+        incomplete += other.incomplete;
+        bytes += other.bytes;
+        failed_connections += other.failed_connections;
+        seconds = std::max(seconds, other.seconds);
+        return *this;
+    }
+};
+
+// Accepts "N" for a fixed payload size or "MIN-MAX" for sizes drawn
+// uniformly from that range.
+static inline bool parse_payload_size(const std::string &spec, size_t &min, size_t &max) {
+    char *end;
+    min = strtoull(spec.c_str(), &end, 10);
+    max = min;
+    if (*end == '-') {
+        max = strtoull(end + 1, &end, 10);
+    }
+
+    return *end == '\0' && min > 0 && min <= max;
+}
+
+#endif //SEASTAR_QUICHE_LOAD_H
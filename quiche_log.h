@@ -0,0 +1,50 @@
+#ifndef SEASTAR_QUICHE_LOG_H
+#define SEASTAR_QUICHE_LOG_H
+
+#include <seastar/util/log.hh>
+#include <chrono>
+
+// Most verbose seastar::log_level compiled into the binaries (error = 0 ..
+// trace = 4). Call sites above it are discarded at compile time, arguments
+// included, so per-packet tracing costs nothing in release builds.
+#ifndef QUICHE_ECHO_MAX_LOG_LEVEL
+#ifdef NDEBUG
+#define QUICHE_ECHO_MAX_LOG_LEVEL 2
+#else
+#define QUICHE_ECHO_MAX_LOG_LEVEL 4
+#endif
+#endif
+
+constexpr bool log_compiled_in(seastar::log_level level) {
+    return static_cast<int>(level) <= QUICHE_ECHO_MAX_LOG_LEVEL;
+}
+
+// Shared by the helpers in quiche_utils.h.
+inline seastar::logger quic_log("quic");
+
+#define QLOG_TRACE(logger, ...) \
+    do { \
+        if constexpr (log_compiled_in(seastar::log_level::trace)) { \
+            (logger).trace(__VA_ARGS__); \
+        } \
+    } while (0)
+
+#define QLOG_DEBUG(logger, ...) \
+    do { \
+        if constexpr (log_compiled_in(seastar::log_level::debug)) { \
+            (logger).debug(__VA_ARGS__); \
+        } \
+    } while (0)
+
+// Logs at most once a second per call site and shard; seastar reports how
+// many messages were dropped with the next one that gets through. For
+// conditions a peer can trigger at packet rate.
+#define QLOG_LIMITED(logger, level, ...) \
+    do { \
+        if constexpr (log_compiled_in(level)) { \
+            static thread_local seastar::logger::rate_limit qlog_rate_limit_(std::chrono::seconds(1)); \
+            (logger).log((level), qlog_rate_limit_, __VA_ARGS__); \
+        } \
+    } while (0)
+
+#endif //SEASTAR_QUICHE_LOG_H
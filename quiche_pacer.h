@@ -0,0 +1,124 @@
+#ifndef SEASTAR_QUICHE_PACER_H
+#define SEASTAR_QUICHE_PACER_H
+
+#include <seastar/core/temporary_buffer.hh>
+#include <seastar/core/timer.hh>
+#include <seastar/net/api.hh>
+#include "quiche_egress.h"
+#include <stdint.h>
+#include <time.h>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+// Packets due within this much of now are released right away.
+#define PACING_GRANULARITY_NS 50000
+
+// Most packets released per timer expiry, later ones wait for the next
+// reactor poll so a deep queue can't monopolize the shard.
+#define PACING_BATCH 16
+
+// Holds back outgoing datagrams until the release time quiche assigned to
+// them (quiche_send_info.at) and sends them from a high resolution timer.
+// Held datagrams stay reserved in the shard's egress_limiter. One instance
+// per shard, shared by all of its connections.
+class pacer {
+    struct item {
+        uint64_t at_ns;
+        // Keeps datagrams with equal release times in submission order.
+        uint64_t seq;
+        seastar::lw_shared_ptr<egress_account> acct;
+        seastar::socket_address dst;
+        seastar::temporary_buffer<char> data;
+    };
+
+    // Makes the item released first the top of a std heap.
+    static bool later(const item &a, const item &b) {
+        return a.at_ns != b.at_ns ? a.at_ns > b.at_ns : a.seq > b.seq;
+    }
+
+    egress_limiter &_egress;
+    std::vector<item> _queue;
+    seastar::timer<seastar::steady_clock_type> _timer;
+    uint64_t _seq = 0;
+
+    static uint64_t now_ns() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                seastar::steady_clock_type::now().time_since_epoch()).count();
+    }
+
+    void arm(uint64_t at_ns) {
+        auto at = seastar::steady_clock_type::time_point(std::chrono::nanoseconds(at_ns));
+        if (!_timer.armed() || at < _timer.get_timeout()) {
+            _timer.rearm(at);
+        }
+    }
+
+    // Due datagrams that follow each other in the queue and belong to one
+    // connection are sent as a segment_run.
+    void release() {
+        uint64_t horizon = now_ns() + PACING_GRANULARITY_NS;
+        segment_run run;
+
+        for (unsigned n = 0; n < PACING_BATCH && !_queue.empty(); n++) {
+            if (_queue.front().at_ns > horizon) {
+                break;
+            }
+
+            std::pop_heap(_queue.begin(), _queue.end(), later);
+            item &next = _queue.back();
+            if (!run.fits(next.acct.get(), next.dst, next.data.size())) {
+                _egress.send(run);
+            }
+            run.add(std::move(next.acct), next.dst, std::move(next.data));
+            _queue.pop_back();
+        }
+        _egress.send(run);
+
+        if (!_queue.empty()) {
+            arm(_queue.front().at_ns);
+        }
+    }
+
+public:
+    explicit pacer(egress_limiter &egress)
+            : _egress(egress), _timer([this] { release(); }) {
+    }
+
+    // The timer callback captures `this`.
+    pacer(const pacer &) = delete;
+    pacer &operator=(const pacer &) = delete;
+
+    size_t queued() const {
+        return _queue.size();
+    }
+
+    // quiche stamps release times from the monotonic clock, same as
+    // seastar's steady_clock.
+    static uint64_t to_ns(const struct timespec &at) {
+        return (uint64_t) at.tv_sec * 1000000000 + at.tv_nsec;
+    }
+
+    // Whether a datagram with release time `at_ns` would be sent right
+    // away; if so the caller may as well send it itself.
+    bool due(uint64_t at_ns) const {
+        bool ahead_of_queue = _queue.empty() || at_ns < _queue.front().at_ns;
+        return ahead_of_queue && at_ns <= now_ns() + PACING_GRANULARITY_NS;
+    }
+
+    // Sends `data` to `dst` once `at_ns` is reached; its size must be
+    // reserved against `acct`.
+    void send(uint64_t at_ns, seastar::lw_shared_ptr<egress_account> acct,
+              const seastar::socket_address &dst, seastar::temporary_buffer<char> data) {
+        if (due(at_ns)) {
+            _egress.send(std::move(acct), dst, std::move(data));
+            return;
+        }
+
+        _queue.push_back(item{at_ns, _seq++, std::move(acct), dst, std::move(data)});
+        std::push_heap(_queue.begin(), _queue.end(), later);
+        arm(_queue.front().at_ns);
+    }
+};
+
+#endif //SEASTAR_QUICHE_PACER_H
@@ -0,0 +1,61 @@
+#ifndef SEASTAR_QUICHE_RANDOM_H
+#define SEASTAR_QUICHE_RANDOM_H
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/random.h>
+
+#define RANDOM_POOL_SIZE 4096
+
+// Kernel randomness fetched RANDOM_POOL_SIZE bytes at a time, so minting a
+// connection ID costs one getrandom() call per ~250 of them instead of an
+// open()/read() each. Bytes are wiped once handed out.
+// One pool per shard, never shared.
+class random_pool {
+    uint8_t _buf[RANDOM_POOL_SIZE];
+    size_t _left = 0;
+
+    bool refill() {
+        size_t got = 0;
+
+        while (got < sizeof(_buf)) {
+            ssize_t n = getrandom(_buf + got, sizeof(_buf) - got, 0);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            got += n;
+        }
+
+        _left = sizeof(_buf);
+        return true;
+    }
+
+public:
+    // Fills `out` with `len` random bytes; false if the kernel refused.
+    bool fill(uint8_t *out, size_t len) {
+        while (len > 0) {
+            if (_left == 0 && !refill()) {
+                return false;
+            }
+
+            size_t n = len < _left ? len : _left;
+            uint8_t *src = _buf + sizeof(_buf) - _left;
+            memcpy(out, src, n);
+            memset(src, 0, n);
+
+            _left -= n;
+            out += n;
+            len -= n;
+        }
+
+        return true;
+    }
+};
+
+inline thread_local random_pool shard_random;
+
+#endif //SEASTAR_QUICHE_RANDOM_H
@@ -0,0 +1,78 @@
+#ifndef SEASTAR_QUICHE_SEND_QUEUE_H
+#define SEASTAR_QUICHE_SEND_QUEUE_H
+
+#include <stddef.h>
+
+// Link embedded in whatever is queued; a zeroed entry is not on a queue.
+struct send_queue_entry {
+    struct send_queue_entry *prev;
+    struct send_queue_entry *next;
+};
+
+// Intrusive FIFO of connections with output pending. Queueing a connection
+// that is already queued keeps its place, so a connection woken several
+// times before its turn is still served once per round.
+class send_queue {
+    // Sentinel of the circular list.
+    send_queue_entry _head;
+    size_t _size = 0;
+
+public:
+    send_queue() {
+        _head.prev = &_head;
+        _head.next = &_head;
+    }
+
+    // The sentinel is linked to itself.
+    send_queue(const send_queue &) = delete;
+    send_queue &operator=(const send_queue &) = delete;
+
+    static bool queued(const send_queue_entry *e) {
+        return e->next != NULL;
+    }
+
+    bool empty() const {
+        return _size == 0;
+    }
+
+    size_t size() const {
+        return _size;
+    }
+
+    void push_back(send_queue_entry *e) {
+        if (queued(e)) {
+            return;
+        }
+
+        e->prev = _head.prev;
+        e->next = &_head;
+        _head.prev->next = e;
+        _head.prev = e;
+        _size++;
+    }
+
+    void remove(send_queue_entry *e) {
+        if (!queued(e)) {
+            return;
+        }
+
+        e->prev->next = e->next;
+        e->next->prev = e->prev;
+        e->prev = NULL;
+        e->next = NULL;
+        _size--;
+    }
+
+    // Unlinks and returns the oldest entry; NULL if the queue is empty.
+    send_queue_entry *pop_front() {
+        if (empty()) {
+            return NULL;
+        }
+
+        send_queue_entry *e = _head.next;
+        remove(e);
+        return e;
+    }
+};
+
+#endif //SEASTAR_QUICHE_SEND_QUEUE_H
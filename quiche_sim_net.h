@@ -0,0 +1,468 @@
+#ifndef SEASTAR_QUICHE_SIM_NET_H
+#define SEASTAR_QUICHE_SIM_NET_H
+
+#include <seastar/core/future.hh>
+#include <seastar/core/timer.hh>
+#include <seastar/net/api.hh>
+#include <seastar/net/packet.hh>
+#include <seastar/net/socket_defs.hh>
+#include <stdint.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <memory>
+#include <optional>
+#include <random>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+// Datagrams a simulated socket holds before it drops, like a full receive
+// buffer.
+#define SIM_SOCKET_QUEUE 4096
+
+// First port handed to channels bound without one.
+#define SIM_EPHEMERAL_PORT 49152
+
+// Behaviour of one direction of the simulated path. A datagram first goes
+// through the loss model, then waits for the bottleneck, then takes the
+// propagation delay.
+struct link_params {
+    // One-way delay, plus a uniformly distributed extra of up to `jitter`.
+    // Jitter reorders datagrams that are closer together than it.
+    std::chrono::microseconds delay{0};
+    std::chrono::microseconds jitter{0};
+    // Bottleneck rate in bits per second, 0 for none.
+    uint64_t rate_bps = 0;
+    // Bytes that may wait for the bottleneck; more are tail dropped.
+    size_t queue_bytes = 256 * 1024;
+    // Mean loss rate. With loss_burst above 1 losses come in bursts of that
+    // mean length (Gilbert-Elliott: every datagram in the bad state is
+    // lost), otherwise each datagram is lost independently.
+    double loss = 0;
+    double loss_burst = 1;
+    // Share of datagrams that skip the delay and so overtake the ones sent
+    // before them (netem's reorder).
+    double reorder = 0;
+    // Share of datagrams delivered twice.
+    double duplicate = 0;
+};
+
+struct link_stats {
+    uint64_t packets = 0;
+    uint64_t bytes = 0;
+    uint64_t lost = 0;
+    uint64_t queue_drops = 0;
+    uint64_t reordered = 0;
+    uint64_t duplicated = 0;
+
+    link_stats &merge(const link_stats &other) {
+        packets += other.packets;
+        bytes += other.bytes;
+        lost += other.lost;
+        queue_drops += other.queue_drops;
+        reordered += other.reordered;
+        duplicated += other.duplicated;
+        return *this;
+    }
+};
+
+// One direction of the path. Shared by every flow going that way, so
+// connections compete for the bottleneck like on a real link. Each link has
+// its own generator and every datagram takes the same number of draws from
+// it, so whether the Nth datagram through a link is lost, delayed by how
+// much, reordered or duplicated only depends on the seed. Queue drops still
+// depend on timing.
+class sim_link {
+    link_params _p;
+    std::mt19937_64 _rng;
+    // When the bottleneck finishes serializing what it has queued.
+    uint64_t _busy_until_ns = 0;
+    bool _bad = false;
+
+    double uniform() {
+        return std::uniform_real_distribution<double>(0, 1)(_rng);
+    }
+
+    bool lose(double draw) {
+        if (_p.loss <= 0) {
+            return false;
+        }
+        if (_p.loss_burst <= 1) {
+            return draw < _p.loss;
+        }
+
+        // Leaving the bad state after a mean of loss_burst datagrams and
+        // entering it at a rate that spends a `loss` share of them there.
+        double leave = 1 / _p.loss_burst;
+        double enter = _p.loss * leave / (1 - _p.loss);
+        if (draw < (_bad ? leave : enter)) {
+            _bad = !_bad;
+        }
+        return _bad;
+    }
+
+    uint64_t propagation_ns(double draw) {
+        return std::chrono::nanoseconds(_p.delay).count() +
+               (uint64_t) (draw * std::chrono::nanoseconds(_p.jitter).count());
+    }
+
+public:
+    link_stats stats;
+
+    // Links of one network share the seed and differ in `stream`.
+    sim_link(const link_params &p, uint64_t seed, uint32_t stream) : _p(p) {
+        std::seed_seq seq{(uint32_t) seed, (uint32_t) (seed >> 32), stream};
+        _rng.seed(seq);
+    }
+
+    // Arrival times of a datagram of `len` bytes sent at `now_ns`: none if
+    // it's dropped, two if it's duplicated.
+    std::vector<uint64_t> transmit(uint64_t now_ns, size_t len) {
+        std::vector<uint64_t> arrivals;
+        stats.packets++;
+        stats.bytes += len;
+
+        double loss_draw = uniform();
+        double reorder_draw = uniform();
+        double duplicate_draw = uniform();
+        double jitter_draw = uniform();
+        double duplicate_jitter_draw = uniform();
+
+        if (lose(loss_draw)) {
+            stats.lost++;
+            return arrivals;
+        }
+
+        uint64_t departure = now_ns;
+        if (_p.rate_bps > 0) {
+            uint64_t start = std::max(now_ns, _busy_until_ns);
+            double queued = (double) (start - now_ns) * _p.rate_bps / 8e9;
+            if (queued + len > _p.queue_bytes) {
+                stats.queue_drops++;
+                return arrivals;
+            }
+
+            departure = start + len * 8000000000ULL / _p.rate_bps;
+            _busy_until_ns = departure;
+        }
+
+        if (reorder_draw < _p.reorder) {
+            stats.reordered++;
+            arrivals.push_back(departure);
+        } else {
+            arrivals.push_back(departure + propagation_ns(jitter_draw));
+        }
+
+        if (duplicate_draw < _p.duplicate) {
+            stats.duplicated++;
+            arrivals.push_back(departure + propagation_ns(duplicate_jitter_draw));
+        }
+
+        return arrivals;
+    }
+};
+
+class sim_network;
+
+// A datagram as handed to a simulated socket.
+class sim_datagram : public seastar::net::udp_datagram_impl {
+    seastar::socket_address _src;
+    seastar::socket_address _dst;
+    seastar::net::packet _data;
+
+public:
+    sim_datagram(const seastar::socket_address &src, const seastar::socket_address &dst,
+                 seastar::net::packet data)
+            : _src(src), _dst(dst), _data(std::move(data)) {
+    }
+
+    seastar::socket_address get_src() override {
+        return _src;
+    }
+
+    seastar::socket_address get_dst() override {
+        return _dst;
+    }
+
+    uint16_t get_dst_port() override {
+        return _dst.port();
+    }
+
+    seastar::net::packet &get_data() override {
+        return _data;
+    }
+};
+
+// A socket on the simulated network, wrapped in a udp_channel. Sending never
+// blocks or fails; what the link does to the datagram is up to its
+// link_params.
+class sim_channel : public seastar::net::udp_channel_impl {
+    sim_network &_net;
+    seastar::socket_address _addr;
+    std::deque<seastar::net::udp_datagram> _queue;
+    std::optional<seastar::promise<seastar::net::udp_datagram>> _waiter;
+    bool _input_shut = false;
+    bool _output_shut = false;
+    bool _bound = true;
+
+public:
+    sim_channel(sim_network &net, const seastar::socket_address &addr) : _net(net), _addr(addr) {
+    }
+
+    ~sim_channel() override;
+
+    seastar::socket_address local_address() const override {
+        return _addr;
+    }
+
+    seastar::future<seastar::net::udp_datagram> receive() override {
+        if (_input_shut) {
+            return seastar::make_exception_future<seastar::net::udp_datagram>(
+                    std::runtime_error("simulated socket input is shut down"));
+        }
+
+        if (!_queue.empty()) {
+            seastar::net::udp_datagram dgram = std::move(_queue.front());
+            _queue.pop_front();
+            return seastar::make_ready_future<seastar::net::udp_datagram>(std::move(dgram));
+        }
+
+        _waiter.emplace();
+        return _waiter->get_future();
+    }
+
+    seastar::future<> send(const seastar::socket_address &dst, const char *msg) override {
+        return send(dst, seastar::net::packet::from_static_data(msg, strlen(msg)));
+    }
+
+    seastar::future<> send(const seastar::socket_address &dst, seastar::net::packet p) override;
+
+    void shutdown_input() override {
+        _input_shut = true;
+        _queue.clear();
+        if (_waiter) {
+            _waiter->set_exception(std::runtime_error("simulated socket input is shut down"));
+            _waiter.reset();
+        }
+    }
+
+    void shutdown_output() override {
+        _output_shut = true;
+    }
+
+    bool is_closed() const override {
+        return _input_shut && _output_shut;
+    }
+
+    void close() override;
+
+    void deliver(const seastar::socket_address &src, const seastar::socket_address &dst,
+                 seastar::net::packet data) {
+        if (_input_shut) {
+            return;
+        }
+
+        seastar::net::udp_datagram dgram(std::make_unique<sim_datagram>(src, dst, std::move(data)));
+        if (_waiter) {
+            _waiter->set_value(std::move(dgram));
+            _waiter.reset();
+        } else if (_queue.size() < SIM_SOCKET_QUEUE) {
+            _queue.push_back(std::move(dgram));
+        }
+    }
+};
+
+// The network of one shard: sockets bound to IPv4 addresses, and a path
+// between the server's port and everyone else, one sim_link per direction.
+// Randomness comes from seeded generators, one per link, so the fate of
+// every datagram a link carries only depends on the seed and on its position
+// in the link's traffic.
+//
+// Time is real: quiche reads the monotonic clock itself, so a virtual clock
+// driving only the link would disagree with quiche's loss recovery and
+// pacing. Runs are reproducible in the link's decisions, not to the
+// nanosecond.
+class sim_network {
+    struct delivery {
+        uint64_t at_ns;
+        // Keeps datagrams with equal arrival times in sending order.
+        uint64_t seq;
+        seastar::socket_address src;
+        seastar::socket_address dst;
+        seastar::net::packet data;
+    };
+
+    static bool later(const delivery &a, const delivery &b) {
+        return a.at_ns != b.at_ns ? a.at_ns > b.at_ns : a.seq > b.seq;
+    }
+
+    static std::pair<uint32_t, uint16_t> key(const seastar::socket_address &addr) {
+        const sockaddr_in &in = addr.as_posix_sockaddr_in();
+        return {in.sin_addr.s_addr, in.sin_port};
+    }
+
+    uint16_t _server_port;
+    sim_link _to_server;
+    sim_link _from_server;
+    std::map<std::pair<uint32_t, uint16_t>, sim_channel *> _sockets;
+    std::vector<delivery> _pending;
+    seastar::timer<seastar::steady_clock_type> _timer;
+    uint64_t _seq = 0;
+    uint16_t _next_port = SIM_EPHEMERAL_PORT;
+    uint64_t _unroutable = 0;
+
+    static uint64_t now_ns() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                seastar::steady_clock_type::now().time_since_epoch()).count();
+    }
+
+    // A socket bound to the address, or to the wildcard address on its port.
+    sim_channel *lookup(const seastar::socket_address &addr) {
+        auto it = _sockets.find(key(addr));
+        if (it == _sockets.end()) {
+            it = _sockets.find({INADDR_ANY, key(addr).second});
+        }
+        return it == _sockets.end() ? nullptr : it->second;
+    }
+
+    void release() {
+        uint64_t now = now_ns();
+
+        while (!_pending.empty() && _pending.front().at_ns <= now) {
+            std::pop_heap(_pending.begin(), _pending.end(), later);
+            delivery &next = _pending.back();
+
+            sim_channel *to = lookup(next.dst);
+            if (to != nullptr) {
+                to->deliver(next.src, next.dst, std::move(next.data));
+            } else {
+                _unroutable++;
+            }
+            _pending.pop_back();
+        }
+
+        if (!_pending.empty()) {
+            _timer.rearm(seastar::steady_clock_type::time_point(std::chrono::nanoseconds(_pending.front().at_ns)));
+        }
+    }
+
+public:
+    sim_network(uint16_t server_port, const link_params &to_server, const link_params &from_server,
+                uint64_t seed)
+            : _server_port(server_port), _to_server(to_server, seed, 0),
+              _from_server(from_server, seed, 1), _timer([this] { release(); }) {
+    }
+
+    // Sockets and the timer point back here.
+    sim_network(const sim_network &) = delete;
+    sim_network &operator=(const sim_network &) = delete;
+
+    // A channel bound to `addr`; port 0 picks a free one on 127.0.0.1.
+    seastar::net::udp_channel bind(seastar::socket_address addr) {
+        if (addr.port() == 0) {
+            while (lookup(seastar::ipv4_addr("127.0.0.1", _next_port)) != nullptr) {
+                _next_port++;
+            }
+            addr = seastar::socket_address(seastar::ipv4_addr("127.0.0.1", _next_port++));
+        }
+
+        if (_sockets.count(key(addr))) {
+            throw std::runtime_error("simulated address already in use");
+        }
+
+        auto chan = std::make_unique<sim_channel>(*this, addr);
+        _sockets[key(addr)] = chan.get();
+        return seastar::net::udp_channel(std::move(chan));
+    }
+
+    void unbind(const seastar::socket_address &addr) {
+        _sockets.erase(key(addr));
+    }
+
+    void transmit(const seastar::socket_address &src, const seastar::socket_address &dst,
+                  seastar::net::packet data) {
+        sim_link &link = dst.port() == _server_port ? _to_server : _from_server;
+
+        std::vector<uint64_t> arrivals = link.transmit(now_ns(), data.len());
+        for (size_t i = 0; i < arrivals.size(); i++) {
+            // The receiver decrypts in place, so a duplicate needs its own
+            // copy.
+            seastar::net::packet copy;
+            if (i + 1 < arrivals.size()) {
+                data.linearize();
+                copy = seastar::net::packet(seastar::net::fragment{data.frag(0).base, data.frag(0).size});
+            } else {
+                copy = std::move(data);
+            }
+
+            _pending.push_back(delivery{arrivals[i], _seq++, src, dst, std::move(copy)});
+            std::push_heap(_pending.begin(), _pending.end(), later);
+        }
+
+        if (!_pending.empty()) {
+            auto at = seastar::steady_clock_type::time_point(std::chrono::nanoseconds(_pending.front().at_ns));
+            if (!_timer.armed() || at < _timer.get_timeout()) {
+                _timer.rearm(at);
+            }
+        }
+    }
+
+    const link_stats &to_server_stats() const {
+        return _to_server.stats;
+    }
+
+    const link_stats &from_server_stats() const {
+        return _from_server.stats;
+    }
+
+    // Datagrams that arrived at an address nobody is bound to.
+    uint64_t unroutable() const {
+        return _unroutable;
+    }
+};
+
+inline sim_channel::~sim_channel() {
+    if (_bound) {
+        _net.unbind(_addr);
+    }
+}
+
+inline seastar::future<> sim_channel::send(const seastar::socket_address &dst, seastar::net::packet p) {
+    if (!_output_shut) {
+        _net.transmit(_addr, dst, std::move(p));
+    }
+    return seastar::make_ready_future<>();
+}
+
+inline void sim_channel::close() {
+    shutdown_input();
+    shutdown_output();
+    if (_bound) {
+        _bound = false;
+        _net.unbind(_addr);
+    }
+}
+
+// Set on every shard of a process running against a simulated network
+// (echo_sim); channels are then opened on it instead of real sockets.
+inline thread_local sim_network *shard_sim_network = nullptr;
+
+static inline seastar::net::udp_channel make_quic_channel(const seastar::socket_address &local) {
+    if (shard_sim_network != nullptr) {
+        return shard_sim_network->bind(local);
+    }
+    return seastar::make_udp_channel(local);
+}
+
+static inline seastar::net::udp_channel make_quic_channel() {
+    if (shard_sim_network != nullptr) {
+        return shard_sim_network->bind(seastar::socket_address(seastar::ipv4_addr()));
+    }
+    return seastar::make_udp_channel();
+}
+
+#endif //SEASTAR_QUICHE_SIM_NET_H
@@ -0,0 +1,95 @@
+#ifndef SEASTAR_QUICHE_SLAB_POOL_H
+#define SEASTAR_QUICHE_SLAB_POOL_H
+
+#include <stddef.h>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+// Objects per slab, 256 connections come to roughly 100 KiB.
+#define SLAB_POOL_OBJECTS 256
+
+// Fixed size object pool. Memory is taken from the allocator a slab at a
+// time and never given back, so a steady rate of connections opening and
+// closing reuses the same slots instead of growing the heap. Freed slots go
+// on a LIFO free list: the next allocation gets the slot released last,
+// which is the one most likely still in cache. One instance per shard.
+template <typename T>
+class slab_pool {
+    union slot {
+        slot *next;
+        alignas(T) unsigned char storage[sizeof(T)];
+    };
+
+    std::vector<std::unique_ptr<slot[]>> _slabs;
+    slot *_free = nullptr;
+    size_t _live = 0;
+
+    bool grow() {
+        slot *slab = new (std::nothrow) slot[SLAB_POOL_OBJECTS];
+        if (slab == nullptr) {
+            return false;
+        }
+        _slabs.emplace_back(slab);
+
+        for (size_t i = SLAB_POOL_OBJECTS; i > 0; i--) {
+            slab[i - 1].next = _free;
+            _free = &slab[i - 1];
+        }
+
+        return true;
+    }
+
+public:
+    slab_pool() = default;
+
+    // Objects point into the slabs.
+    slab_pool(const slab_pool &) = delete;
+    slab_pool &operator=(const slab_pool &) = delete;
+
+    // Constructs a T in a free slot; nullptr if no memory is left or the
+    // constructor throws.
+    template <typename... Args>
+    T *make(Args &&... args) {
+        if (_free == nullptr && !grow()) {
+            return nullptr;
+        }
+
+        slot *s = _free;
+        _free = s->next;
+
+        T *obj;
+        try {
+            obj = new (s->storage) T(std::forward<Args>(args)...);
+        } catch (...) {
+            s->next = _free;
+            _free = s;
+            return nullptr;
+        }
+
+        _live++;
+        return obj;
+    }
+
+    // Runs the destructor of an object obtained from make() and recycles
+    // its slot.
+    void destroy(T *obj) {
+        obj->~T();
+
+        slot *s = reinterpret_cast<slot *>(obj);
+        s->next = _free;
+        _free = s;
+        _live--;
+    }
+
+    size_t live() const {
+        return _live;
+    }
+
+    size_t capacity() const {
+        return _slabs.size() * SLAB_POOL_OBJECTS;
+    }
+};
+
+#endif //SEASTAR_QUICHE_SLAB_POOL_H
@@ -0,0 +1,142 @@
+#ifndef SEASTAR_QUICHE_STAGE_TIMER_H
+#define SEASTAR_QUICHE_STAGE_TIMER_H
+
+#include <stdint.h>
+#include <time.h>
+#include "quiche_histogram.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Stages of the server's per-packet path, timed separately.
+enum hot_stage {
+    // quiche_header_info() on a received datagram, counted on the shard
+    // that handles it.
+    STAGE_HEADER_PARSE,
+    // Handing a datagram to the shard owning its connection.
+    STAGE_FORWARD,
+    // Finding the datagram's connection by its connection ID.
+    STAGE_CONN_LOOKUP,
+    // quiche_conn_recv().
+    STAGE_CONN_RECV,
+    // Stream, HTTP/3 and DATAGRAM work after a packet was processed.
+    STAGE_APP,
+    // One quiche_conn_send() call, i.e. building one packet.
+    STAGE_PACKETIZE,
+    // Handing a packet to the pacer or the channel.
+    STAGE_SUBMIT,
+    STAGE_COUNT,
+};
+
+inline const char *const hot_stage_names[STAGE_COUNT] = {
+        "header_parse",
+        "forward",
+        "conn_lookup",
+        "conn_recv",
+        "app",
+        "packetize",
+        "submit",
+};
+
+// Cheapest timestamp the CPU has: the TSC on x86, the virtual counter on
+// ARM, the monotonic clock elsewhere. Neither counter instruction is
+// serializing, which blurs a few cycles at the edges of a stage; that's
+// well below what the stages themselves take.
+static inline uint64_t read_cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#elif defined(__aarch64__)
+    uint64_t v;
+    asm volatile("mrs %0, cntvct_el0" : "=r"(v));
+    return v;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static inline uint64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Converts read_cycles() differences to nanoseconds. The rate is measured
+// against the monotonic clock over everything since start(), so it gets
+// more precise the longer the process runs and costs nothing up front.
+// Assumes a constant rate counter that's in sync across cores, as the TSC
+// of any recent x86 and ARM's generic timer are.
+class cycle_clock {
+    uint64_t _base_cycles = 0;
+    uint64_t _base_ns = 0;
+
+public:
+    void start() {
+        _base_ns = monotonic_ns();
+        _base_cycles = read_cycles();
+    }
+
+    double ns_per_cycle() const {
+        uint64_t cycles = read_cycles() - _base_cycles;
+        uint64_t ns = monotonic_ns() - _base_ns;
+        return cycles ? (double) ns / cycles : 1;
+    }
+};
+
+// Stage durations in cycles, one histogram per stage.
+struct stage_histograms {
+    log_histogram stages[STAGE_COUNT];
+
+    stage_histograms &merge(const stage_histograms &other) {
+        for (unsigned s = 0; s < STAGE_COUNT; s++) {
+            stages[s].merge(other.stages[s]);
+        }
+        return *this;
+    }
+};
+
+// Times the stages of one shard. Switched off, start() is a load and a
+// branch and stop() a compare; on, each adds a counter read, and stop()
+// a histogram update. One instance per shard.
+class stage_timer {
+    bool _enabled = false;
+    stage_histograms _hist;
+
+public:
+    bool enabled() const {
+        return _enabled;
+    }
+
+    void set_enabled(bool on) {
+        _enabled = on;
+    }
+
+    // A timestamp to pass to stop(), 0 while switched off.
+    uint64_t start() const {
+        return _enabled ? read_cycles() : 0;
+    }
+
+    // Records the stage begun at `started`, unless that was while switched
+    // off.
+    void stop(hot_stage s, uint64_t started) {
+        if (started != 0) {
+            _hist.stages[s].record(read_cycles() - started);
+        }
+    }
+
+    // Records a stage that ran from `started` to `ended`, both from
+    // start().
+    void record(hot_stage s, uint64_t started, uint64_t ended) {
+        if (started != 0 && ended != 0) {
+            _hist.stages[s].record(ended - started);
+        }
+    }
+
+    const stage_histograms &histograms() const {
+        return _hist;
+    }
+};
+
+#endif //SEASTAR_QUICHE_STAGE_TIMER_H
@@ -0,0 +1,233 @@
+#ifndef SEASTAR_QUICHE_TIMER_WHEEL_H
+#define SEASTAR_QUICHE_TIMER_WHEEL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Intrusive hook of an object scheduled on a timer_wheel. A zeroed entry is
+// not scheduled, so it can live in calloc'ed memory.
+struct timer_wheel_entry {
+    struct timer_wheel_entry *prev;
+    struct timer_wheel_entry *next;
+    // Tick at which the entry expires.
+    uint64_t expires;
+    // Level * TIMER_WHEEL_SLOTS + slot the entry is linked into.
+    unsigned slot;
+};
+
+#define TIMER_WHEEL_LEVEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1u << TIMER_WHEEL_LEVEL_BITS)
+#define TIMER_WHEEL_LEVELS 4
+
+// Hierarchical timer wheel: TIMER_WHEEL_LEVELS levels of TIMER_WHEEL_SLOTS
+// slots each, level N slots span 64^N ticks. Scheduling, rescheduling and
+// cancelling are O(1); entries of higher levels are cascaded down as time
+// reaches their slot. A per level occupancy bitmap gives the next tick with
+// work, so the owner can sleep until then instead of ticking.
+//
+// Time is given in nanoseconds of any monotonic clock, a tick is
+// 2^tick_shift nanoseconds.
+class timer_wheel {
+    unsigned _tick_shift;
+    // Next tick to be processed, everything before it has fired.
+    uint64_t _now;
+    size_t _size = 0;
+    uint64_t _occupied[TIMER_WHEEL_LEVELS] = {};
+    // List heads (sentinels) of every slot.
+    timer_wheel_entry _slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+
+    static constexpr uint64_t max_delta() {
+        return (uint64_t) 1 << (TIMER_WHEEL_LEVEL_BITS * TIMER_WHEEL_LEVELS);
+    }
+
+    static void init_list(timer_wheel_entry *head) {
+        head->prev = head;
+        head->next = head;
+    }
+
+    void place(timer_wheel_entry *e) {
+        uint64_t delta = e->expires - _now;
+        unsigned level = 0;
+        while (delta >= ((uint64_t) 1 << (TIMER_WHEEL_LEVEL_BITS * (level + 1)))) {
+            level++;
+        }
+
+        unsigned idx = (e->expires >> (TIMER_WHEEL_LEVEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1);
+        timer_wheel_entry *head = &_slots[level][idx];
+
+        e->slot = level * TIMER_WHEEL_SLOTS + idx;
+        e->prev = head->prev;
+        e->next = head;
+        head->prev->next = e;
+        head->prev = e;
+
+        _occupied[level] |= (uint64_t) 1 << idx;
+    }
+
+    // Moves the whole list of a slot to `out` and marks the slot empty.
+    void detach(unsigned level, unsigned idx, timer_wheel_entry *out) {
+        timer_wheel_entry *head = &_slots[level][idx];
+
+        init_list(out);
+        if (head->next != head) {
+            out->next = head->next;
+            out->prev = head->prev;
+            out->next->prev = out;
+            out->prev->next = out;
+            init_list(head);
+        }
+
+        _occupied[level] &= ~((uint64_t) 1 << idx);
+    }
+
+    void cascade(unsigned level, unsigned idx) {
+        timer_wheel_entry list;
+        detach(level, idx, &list);
+
+        while (list.next != &list) {
+            timer_wheel_entry *e = list.next;
+            list.next = e->next;
+            e->next->prev = &list;
+            place(e);
+        }
+    }
+
+    // Smallest tick at or after _now at which some slot fires or cascades.
+    uint64_t next_tick() const {
+        uint64_t best = UINT64_MAX;
+
+        for (unsigned level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+            if (_occupied[level] == 0) {
+                continue;
+            }
+
+            unsigned shift = TIMER_WHEEL_LEVEL_BITS * level;
+            uint64_t first = (_now + ((uint64_t) 1 << shift) - 1) >> shift;
+            unsigned idx = first & (TIMER_WHEEL_SLOTS - 1);
+            uint64_t rotated = (_occupied[level] >> idx) | (idx ? _occupied[level] << (64 - idx) : 0);
+            uint64_t tick = (first + __builtin_ctzll(rotated)) << shift;
+
+            if (tick < best) {
+                best = tick;
+            }
+        }
+
+        return best;
+    }
+
+public:
+    static_assert(TIMER_WHEEL_SLOTS == 64, "occupancy bitmaps are 64 bit wide");
+
+    timer_wheel(unsigned tick_shift, uint64_t now_ns)
+            : _tick_shift(tick_shift), _now(now_ns >> tick_shift) {
+        for (unsigned level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+            for (unsigned idx = 0; idx < TIMER_WHEEL_SLOTS; idx++) {
+                init_list(&_slots[level][idx]);
+            }
+        }
+    }
+
+    // Slots are list heads the entries point back to.
+    timer_wheel(const timer_wheel &) = delete;
+    timer_wheel &operator=(const timer_wheel &) = delete;
+
+    size_t size() const {
+        return _size;
+    }
+
+    static bool scheduled(const timer_wheel_entry *e) {
+        return e->next != NULL;
+    }
+
+    // (Re)schedules `e` to expire at `deadline_ns`, rounded up to the next
+    // tick. Deadlines beyond the range of the wheel are clamped to it.
+    void schedule(timer_wheel_entry *e, uint64_t deadline_ns) {
+        cancel(e);
+
+        uint64_t expires = (deadline_ns + ((uint64_t) 1 << _tick_shift) - 1) >> _tick_shift;
+        if (expires < _now) {
+            expires = _now;
+        }
+        if (expires - _now >= max_delta()) {
+            expires = _now + max_delta() - 1;
+        }
+
+        e->expires = expires;
+        place(e);
+        _size++;
+    }
+
+    void cancel(timer_wheel_entry *e) {
+        if (!scheduled(e)) {
+            return;
+        }
+
+        e->prev->next = e->next;
+        e->next->prev = e->prev;
+        e->prev = NULL;
+        e->next = NULL;
+        _size--;
+
+        unsigned level = e->slot / TIMER_WHEEL_SLOTS;
+        unsigned idx = e->slot % TIMER_WHEEL_SLOTS;
+        timer_wheel_entry *head = &_slots[level][idx];
+        if (head->next == head) {
+            _occupied[level] &= ~((uint64_t) 1 << idx);
+        }
+    }
+
+    // Time at which advance() has work to do next, UINT64_MAX if idle.
+    uint64_t next_deadline_ns() const {
+        if (_size == 0) {
+            return UINT64_MAX;
+        }
+
+        return next_tick() << _tick_shift;
+    }
+
+    // Fires every entry that expired by `now_ns`, oldest tick first. `func`
+    // is called with the entry already unlinked and may reschedule or cancel
+    // any entry, including the one it was called for.
+    template <typename Func>
+    void advance(uint64_t now_ns, Func &&func) {
+        uint64_t target = now_ns >> _tick_shift;
+
+        while (_size > 0) {
+            uint64_t tick = next_tick();
+            if (tick > target) {
+                break;
+            }
+
+            _now = tick;
+            for (unsigned level = TIMER_WHEEL_LEVELS - 1; level > 0; level--) {
+                unsigned shift = TIMER_WHEEL_LEVEL_BITS * level;
+                if ((tick & (((uint64_t) 1 << shift) - 1)) == 0) {
+                    cascade(level, (tick >> shift) & (TIMER_WHEEL_SLOTS - 1));
+                }
+            }
+
+            timer_wheel_entry expired;
+            detach(0, tick & (TIMER_WHEEL_SLOTS - 1), &expired);
+
+            // Anything scheduled from `func` lands after this tick.
+            _now = tick + 1;
+
+            while (expired.next != &expired) {
+                timer_wheel_entry *e = expired.next;
+                expired.next = e->next;
+                e->next->prev = &expired;
+                e->prev = NULL;
+                e->next = NULL;
+                _size--;
+
+                func(e);
+            }
+        }
+
+        if (_now <= target) {
+            _now = target + 1;
+        }
+    }
+};
+
+#endif //SEASTAR_QUICHE_TIMER_WHEEL_H
@@ -0,0 +1,243 @@
+#ifndef SEASTAR_QUICHE_TOKEN_H
+#define SEASTAR_QUICHE_TOKEN_H
+
+#include "quiche.h"
+#include <openssl/crypto.h>
+#include <openssl/digest.h>
+#include <openssl/hmac.h>
+#include <openssl/sha.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+// Address validation tokens sent in Retry packets:
+//
+//   epoch (1) | issued, seconds (4) | odcid length (1) | odcid | tag (16)
+//
+// The tag is HMAC-SHA256, truncated to 16 bytes, over everything before it
+// plus the client's address and port and the source connection ID of the
+// Retry, so a token is only good for the address it was minted for and
+// only in an Initial sent to the connection ID the Retry handed out (RFC
+// 9000, section 8.1.4). That ID is not stored, the client sends it as the
+// Initial's DCID. Keys are derived per epoch from one process-wide
+// secret; every shard derives the same keys on its own, so a token minted on
+// one core validates on any other. Tokens of the previous epoch remain valid
+// so rotation doesn't cut off a handshake in flight.
+
+#define TOKEN_TAG_LEN 16
+
+#define MAX_TOKEN_LEN (1 + 4 + 1 + QUICHE_MAX_CONN_ID_LEN + TOKEN_TAG_LEN)
+
+// Room for tokens in received Initials. Clients may present tokens we
+// didn't mint (NEW_TOKEN tokens of another server, or of an older build
+// behind the same address); those have to parse so they can be ignored.
+#define MAX_PARSED_TOKEN_LEN 512
+
+// How long a token stays valid after it was minted.
+#define TOKEN_LIFETIME_S 10
+
+// Keys rotate every TOKEN_KEY_EPOCH_S seconds.
+#define TOKEN_KEY_EPOCH_S 300
+
+// HMAC-SHA256 key of BoringSSL, which quiche links anyway. The context
+// keeps the padded key absorbed, so a MAC costs no key setup.
+class hmac_key {
+    HMAC_CTX _ctx;
+
+public:
+    hmac_key() {
+        HMAC_CTX_init(&_ctx);
+    }
+
+    ~hmac_key() {
+        HMAC_CTX_cleanup(&_ctx);
+    }
+
+    // The context owns digest state on the heap.
+    hmac_key(const hmac_key &) = delete;
+    hmac_key &operator=(const hmac_key &) = delete;
+
+    bool init(const uint8_t *secret, size_t secret_len) {
+        return HMAC_Init_ex(&_ctx, secret, secret_len, EVP_sha256(), NULL) == 1;
+    }
+
+    bool copy_from(const hmac_key &other) {
+        return HMAC_CTX_copy_ex(&_ctx, &other._ctx) == 1;
+    }
+
+    // Computes the MAC of `a` followed by `b` into `out`, which must have
+    // room for SHA256_DIGEST_LENGTH bytes.
+    bool mac(const uint8_t *a, size_t a_len, const uint8_t *b, size_t b_len, uint8_t *out) {
+        unsigned int out_len;
+
+        return HMAC_Init_ex(&_ctx, NULL, 0, NULL, NULL) == 1 &&
+               HMAC_Update(&_ctx, a, a_len) == 1 &&
+               HMAC_Update(&_ctx, b, b_len) == 1 &&
+               HMAC_Final(&_ctx, out, &out_len) == 1;
+    }
+};
+
+// Process-wide secret the epoch keys are derived from. Written once before
+// the shards start, read-only afterwards.
+inline uint8_t token_master_secret[32];
+
+// Serializes the parts of the peer's address a token is bound to.
+static inline size_t token_addr_bytes(const struct sockaddr_storage *addr, uint8_t *out) {
+    if (addr->ss_family == AF_INET6) {
+        const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *) addr;
+        memcpy(out, &in6->sin6_port, 2);
+        memcpy(out + 2, &in6->sin6_addr, 16);
+        return 18;
+    }
+
+    const struct sockaddr_in *in = (const struct sockaddr_in *) addr;
+    memcpy(out, &in->sin_port, 2);
+    memcpy(out + 2, &in->sin_addr, 4);
+    return 6;
+}
+
+// Token keys of one shard: keys of the current and the previous epoch,
+// re-derived from the master secret when the epoch changes.
+class token_keys {
+    uint64_t _epoch = UINT64_MAX;
+    hmac_key _current;
+    hmac_key _previous;
+
+    static bool derive(uint64_t epoch, hmac_key *key) {
+        uint8_t epoch_be[8];
+        for (unsigned i = 0; i < 8; i++) {
+            epoch_be[i] = (uint8_t) (epoch >> (56 - 8 * i));
+        }
+
+        static const uint8_t label[] = "quic retry token";
+        uint8_t msg[sizeof(label) - 1 + sizeof(epoch_be)];
+        memcpy(msg, label, sizeof(label) - 1);
+        memcpy(msg + sizeof(label) - 1, epoch_be, sizeof(epoch_be));
+
+        uint8_t secret[SHA256_DIGEST_LENGTH];
+        unsigned int secret_len;
+        if (HMAC(EVP_sha256(), token_master_secret, sizeof(token_master_secret),
+                 msg, sizeof(msg), secret, &secret_len) == NULL) {
+            return false;
+        }
+        return key->init(secret, secret_len);
+    }
+
+    bool refresh(uint64_t now_s) {
+        uint64_t epoch = now_s / TOKEN_KEY_EPOCH_S;
+        if (epoch == _epoch) {
+            return true;
+        }
+
+        bool ok;
+        if (_epoch != UINT64_MAX && epoch == _epoch + 1) {
+            ok = _previous.copy_from(_current);
+        } else {
+            ok = derive(epoch - 1, &_previous);
+        }
+        if (!ok || !derive(epoch, &_current)) {
+            _epoch = UINT64_MAX;
+            return false;
+        }
+        _epoch = epoch;
+        return true;
+    }
+
+    static bool tag(hmac_key *key, const uint8_t *token, size_t len,
+                    const struct sockaddr_storage *addr, const uint8_t *rscid, size_t rscid_len,
+                    uint8_t *out) {
+        uint8_t bound[18 + QUICHE_MAX_CONN_ID_LEN];
+        uint8_t mac[SHA256_DIGEST_LENGTH];
+
+        if (rscid_len > QUICHE_MAX_CONN_ID_LEN) {
+            return false;
+        }
+        size_t bound_len = token_addr_bytes(addr, bound);
+        memcpy(bound + bound_len, rscid, rscid_len);
+        bound_len += rscid_len;
+
+        if (!key->mac(token, len, bound, bound_len, mac)) {
+            return false;
+        }
+        memcpy(out, mac, TOKEN_TAG_LEN);
+        return true;
+    }
+
+public:
+    // `token` must have room for MAX_TOKEN_LEN bytes. `now_s` is any
+    // monotonic clock in seconds shared by all shards. `rscid` is the
+    // source connection ID of the Retry carrying the token. False if
+    // BoringSSL failed, which only happens when it runs out of memory.
+    bool mint(const uint8_t *odcid, size_t odcid_len, const struct sockaddr_storage *addr,
+              const uint8_t *rscid, size_t rscid_len,
+              uint64_t now_s, uint8_t *token, size_t *token_len) {
+        if (!refresh(now_s)) {
+            return false;
+        }
+
+        uint32_t issued = (uint32_t) now_s;
+        size_t len = 0;
+
+        token[len++] = (uint8_t) _epoch;
+        memcpy(token + len, &issued, sizeof(issued));
+        len += sizeof(issued);
+        token[len++] = (uint8_t) odcid_len;
+        memcpy(token + len, odcid, odcid_len);
+        len += odcid_len;
+
+        if (!tag(&_current, token, len, addr, rscid, rscid_len, token + len)) {
+            return false;
+        }
+        *token_len = len + TOKEN_TAG_LEN;
+        return true;
+    }
+
+    // Checks a token's tag, address, Retry connection ID (`dcid`, the
+    // destination of the Initial carrying it) and age. On success the
+    // original DCID is copied to `odcid`.
+    bool validate(const uint8_t *token, size_t token_len, const struct sockaddr_storage *addr,
+                  const uint8_t *dcid, size_t dcid_len,
+                  uint64_t now_s, uint8_t *odcid, size_t *odcid_len) {
+        if (!refresh(now_s)) {
+            return false;
+        }
+
+        if (token_len < 1 + 4 + 1 + TOKEN_TAG_LEN) {
+            return false;
+        }
+
+        size_t cid_len = token[5];
+        size_t len = 1 + 4 + 1 + cid_len;
+        if (cid_len > QUICHE_MAX_CONN_ID_LEN || token_len != len + TOKEN_TAG_LEN || cid_len > *odcid_len) {
+            return false;
+        }
+
+        hmac_key *key;
+        if (token[0] == (uint8_t) _epoch) {
+            key = &_current;
+        } else if (token[0] == (uint8_t) (_epoch - 1)) {
+            key = &_previous;
+        } else {
+            return false;
+        }
+
+        uint8_t expected[TOKEN_TAG_LEN];
+        if (!tag(key, token, len, addr, dcid, dcid_len, expected) ||
+            CRYPTO_memcmp(expected, token + len, TOKEN_TAG_LEN) != 0) {
+            return false;
+        }
+
+        uint32_t issued;
+        memcpy(&issued, token + 1, sizeof(issued));
+        if ((uint32_t) now_s - issued > TOKEN_LIFETIME_S) {
+            return false;
+        }
+
+        memcpy(odcid, token + 6, cid_len);
+        *odcid_len = cid_len;
+        return true;
+    }
+};
+
+#endif //SEASTAR_QUICHE_TOKEN_H
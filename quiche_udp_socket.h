@@ -0,0 +1,473 @@
+#ifndef SEASTAR_QUICHE_UDP_SOCKET_H
+#define SEASTAR_QUICHE_UDP_SOCKET_H
+
+#include <seastar/core/future.hh>
+#include <seastar/core/internal/pollable_fd.hh>
+#include <seastar/core/posix.hh>
+#include <seastar/core/reactor.hh>
+#include <seastar/core/temporary_buffer.hh>
+#include <seastar/net/api.hh>
+#include <seastar/net/packet.hh>
+#include "quiche_buffer_pool.h"
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <algorithm>
+#include <memory>
+#include <new>
+#include <system_error>
+#include <vector>
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+// Most datagrams the kernel accepts in one GSO send, and most sent per
+// sendmmsg() call or messages received per recvmmsg() call.
+#define UDP_MAX_SEGMENTS 64
+
+// Largest UDP payload of a GSO send, i.e. of all its segments together
+// (IPv4's limit, the tighter one).
+#define UDP_GSO_MAX_BYTES 65507
+
+// Received messages are read into a buffer of this size, more than any UDP
+// payload or GRO batch.
+#define UDP_RECV_BUFFER_SIZE 65536
+
+// Idle receive buffers a channel keeps for reuse, enough to refill every
+// message of a recvmmsg() batch.
+#define UDP_RECV_POOL_BYTES (UDP_MAX_SEGMENTS * UDP_RECV_BUFFER_SIZE)
+
+// A datagram taken off the socket by udp_socket_channel::receive_batch().
+// The payload is a slice of a pooled receive buffer.
+struct received_datagram {
+    seastar::socket_address src;
+    seastar::temporary_buffer<char> data;
+};
+
+class socket_datagram : public seastar::net::udp_datagram_impl {
+    seastar::socket_address _src;
+    seastar::socket_address _dst;
+    seastar::net::packet _data;
+
+public:
+    socket_datagram(const seastar::socket_address &src, const seastar::socket_address &dst,
+                    seastar::net::packet data)
+            : _src(src), _dst(dst), _data(std::move(data)) {
+    }
+
+    seastar::socket_address get_src() override {
+        return _src;
+    }
+
+    seastar::socket_address get_dst() override {
+        return _dst;
+    }
+
+    uint16_t get_dst_port() override {
+        return _dst.port();
+    }
+
+    seastar::net::packet &get_data() override {
+        return _data;
+    }
+};
+
+// A UDP socket of the server's own, wrapped in a udp_channel, so outgoing
+// bursts can be handed to the kernel in one syscall: a single sendmsg()
+// with a UDP_SEGMENT control message that the kernel (or the NIC) splits
+// into datagrams, or sendmmsg() where GSO isn't available. The socket is
+// bound with SO_REUSEPORT, so every shard can bind the same port and the
+// kernel spreads peers over them. Incoming datagrams are taken in batches
+// too, by recvmmsg(), with UDP_GRO where the kernel coalesces a flow's
+// datagrams into one message. Only one receive() or receive_batch() may be
+// outstanding.
+class udp_socket_channel : public seastar::net::udp_channel_impl {
+    // A sendmsg() in flight and everything it points to.
+    struct send_state {
+        seastar::socket_address dst;
+        std::vector<struct iovec> iov;
+        union {
+            char buf[CMSG_SPACE(sizeof(uint16_t))];
+            struct cmsghdr align;
+        } control;
+        struct msghdr msg;
+        seastar::net::packet keep;
+    };
+
+    seastar::pollable_fd _fd;
+    seastar::socket_address _addr;
+    // Cleared for good once the kernel refuses a GSO send.
+    bool _gso;
+    // The kernel may hand over several datagrams of a flow as one message.
+    bool _gro;
+    bool _closed = false;
+    uint64_t _send_syscalls = 0;
+
+    // Receive side. Datagrams are read into chunks of the channel's own
+    // pool and handed over in them, so a datagram owns its payload without
+    // a copy and the chunk comes back once the datagram is dropped.
+    buffer_pool _recv_pool;
+    // Datagrams receive() took off the socket but hasn't returned yet: the
+    // rest of a GRO message, handed out one per call.
+    std::vector<received_datagram> _recv_pending;
+    size_t _recv_next = 0;
+
+    // recvmmsg() slots. A slot keeps its buffer until a message lands in
+    // it, so only the buffers handed out are replaced.
+    struct recv_slot {
+        seastar::temporary_buffer<char> buf;
+        struct sockaddr_storage src;
+        struct iovec iov;
+        union {
+            char buf[CMSG_SPACE(sizeof(int))];
+            struct cmsghdr align;
+        } control;
+    };
+    recv_slot _recv_slots[UDP_MAX_SEGMENTS];
+    struct mmsghdr _recv_mmsg[UDP_MAX_SEGMENTS];
+
+    // sendmmsg() arguments, only live during the call.
+    struct mmsghdr _mmsg[UDP_MAX_SEGMENTS];
+    struct iovec _mmsg_iov[UDP_MAX_SEGMENTS];
+
+    static seastar::file_desc open_socket(const seastar::socket_address &local) {
+        auto fd = seastar::file_desc::socket(local.u.sa.sa_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        fd.setsockopt(SOL_SOCKET, SO_REUSEPORT, 1);
+        seastar::socket_address addr = local;
+        fd.bind(addr.u.sa, addr.length());
+        return fd;
+    }
+
+    static seastar::socket_address address_of(const struct sockaddr_storage &addr) {
+        if (addr.ss_family == AF_INET6) {
+            return seastar::socket_address(*reinterpret_cast<const sockaddr_in6 *>(&addr));
+        }
+
+        return seastar::socket_address(*reinterpret_cast<const sockaddr_in *>(&addr));
+    }
+
+    static int error_of(std::exception_ptr ex) {
+        try {
+            std::rethrow_exception(ex);
+        } catch (const std::system_error &e) {
+            return e.code().value();
+        } catch (...) {
+            return 0;
+        }
+    }
+
+    int raw_fd() {
+        return _fd.get_file_desc().get();
+    }
+
+    // Sends segs[begin, end) as one GSO burst; all but the last segment
+    // have the size of the first.
+    seastar::future<> send_gso(const seastar::socket_address &dst,
+                               std::vector<seastar::temporary_buffer<char>> &segs, size_t begin, size_t end) {
+        auto state = std::make_unique<send_state>();
+        state->dst = dst;
+        for (size_t i = begin; i < end; i++) {
+            state->iov.push_back(iovec{segs[i].get_write(), segs[i].size()});
+        }
+
+        memset(&state->msg, 0, sizeof(state->msg));
+        state->msg.msg_name = &state->dst.u.sa;
+        state->msg.msg_namelen = state->dst.length();
+        state->msg.msg_iov = state->iov.data();
+        state->msg.msg_iovlen = state->iov.size();
+        state->msg.msg_control = state->control.buf;
+        state->msg.msg_controllen = sizeof(state->control.buf);
+
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&state->msg);
+        cm->cmsg_level = SOL_UDP;
+        cm->cmsg_type = UDP_SEGMENT;
+        cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        uint16_t segment_size = segs[begin].size();
+        memcpy(CMSG_DATA(cm), &segment_size, sizeof(segment_size));
+
+        _send_syscalls++;
+        auto sent = _fd.sendmsg(&state->msg);
+        return sent.then_wrapped([this, state = std::move(state), dst, &segs, begin, end](seastar::future<size_t> f) {
+            if (!f.failed()) {
+                f.ignore_ready_future();
+                return seastar::make_ready_future<>();
+            }
+
+            // EIO: the device can't checksum offload, EINVAL: the kernel
+            // doesn't know UDP_SEGMENT. Neither gets better later.
+            std::exception_ptr ex = f.get_exception();
+            int err = error_of(ex);
+            if (err == EIO || err == EINVAL) {
+                _gso = false;
+                return send_each(dst, segs, begin, end);
+            }
+            return seastar::make_exception_future<>(ex);
+        });
+    }
+
+    // Sends segs[begin, end) with sendmmsg(), waiting for room in the
+    // socket buffer as needed.
+    seastar::future<> send_each(const seastar::socket_address &dst,
+                                std::vector<seastar::temporary_buffer<char>> &segs, size_t begin, size_t end) {
+        while (begin < end) {
+            unsigned count = std::min(end - begin, (size_t) UDP_MAX_SEGMENTS);
+            for (unsigned i = 0; i < count; i++) {
+                _mmsg_iov[i] = iovec{segs[begin + i].get_write(), segs[begin + i].size()};
+                memset(&_mmsg[i], 0, sizeof(_mmsg[i]));
+                _mmsg[i].msg_hdr.msg_name = const_cast<struct sockaddr *>(&dst.u.sa);
+                _mmsg[i].msg_hdr.msg_namelen = dst.length();
+                _mmsg[i].msg_hdr.msg_iov = &_mmsg_iov[i];
+                _mmsg[i].msg_hdr.msg_iovlen = 1;
+            }
+
+            _send_syscalls++;
+            int sent = ::sendmmsg(raw_fd(), _mmsg, count, 0);
+            if (sent < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    return _fd.writeable().then([this, dst, &segs, begin, end] {
+                        return send_each(dst, segs, begin, end);
+                    });
+                }
+                return seastar::make_exception_future<>(
+                        std::system_error(errno, std::system_category(), "sendmmsg"));
+            }
+            begin += sent;
+        }
+
+        return seastar::make_ready_future<>();
+    }
+
+    // Sends segs[begin, end) in GSO bursts the kernel accepts.
+    seastar::future<> send_bursts(const seastar::socket_address &dst,
+                                  std::vector<seastar::temporary_buffer<char>> &segs, size_t begin) {
+        if (begin == segs.size()) {
+            return seastar::make_ready_future<>();
+        }
+        if (!_gso) {
+            return send_each(dst, segs, begin, segs.size());
+        }
+
+        size_t end = begin;
+        size_t bytes = 0;
+        while (end < segs.size() && end - begin < UDP_MAX_SEGMENTS &&
+               bytes + segs[end].size() <= UDP_GSO_MAX_BYTES) {
+            bytes += segs[end].size();
+            end++;
+        }
+
+        return send_gso(dst, segs, begin, end).then([this, dst, &segs, end] {
+            return send_bursts(dst, segs, end);
+        });
+    }
+
+    // Size of the datagrams a GRO message was coalesced from, 0 if it
+    // holds a single datagram.
+    static size_t gro_segment_size(struct msghdr *msg) {
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(msg); cm != NULL; cm = CMSG_NXTHDR(msg, cm)) {
+            if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+                int size;
+                memcpy(&size, CMSG_DATA(cm), sizeof(size));
+                return size > 0 ? size : 0;
+            }
+        }
+
+        return 0;
+    }
+
+    // One recvmmsg() of up to `max` messages. Returns the messages taken,
+    // or -1 with errno set.
+    int receive_messages(unsigned max, std::vector<received_datagram> &out) {
+        unsigned count = 0;
+        for (; count < max; count++) {
+            recv_slot &slot = _recv_slots[count];
+            if (slot.buf.empty()) {
+                slot.buf = _recv_pool.get(UDP_RECV_BUFFER_SIZE);
+                if (slot.buf.empty()) {
+                    break;
+                }
+            }
+
+            slot.iov = iovec{slot.buf.get_write(), slot.buf.size()};
+            memset(&_recv_mmsg[count], 0, sizeof(_recv_mmsg[count]));
+            struct msghdr &msg = _recv_mmsg[count].msg_hdr;
+            msg.msg_name = &slot.src;
+            msg.msg_namelen = sizeof(slot.src);
+            msg.msg_iov = &slot.iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = slot.control.buf;
+            msg.msg_controllen = sizeof(slot.control.buf);
+        }
+        if (count == 0) {
+            errno = ENOMEM;
+            return -1;
+        }
+
+        int got = ::recvmmsg(raw_fd(), _recv_mmsg, count, MSG_DONTWAIT, NULL);
+        for (int i = 0; i < got; i++) {
+            recv_slot &slot = _recv_slots[i];
+            struct msghdr &msg = _recv_mmsg[i].msg_hdr;
+            size_t len = _recv_mmsg[i].msg_len;
+
+            // Larger than the buffer, which no datagram can be; it's
+            // dropped and the slot keeps its buffer.
+            if (msg.msg_flags & MSG_TRUNC) {
+                continue;
+            }
+
+            seastar::socket_address src = address_of(slot.src);
+            seastar::temporary_buffer<char> buf = std::move(slot.buf);
+            size_t segment = gro_segment_size(&msg);
+            if (segment == 0 || segment >= len) {
+                buf.trim(len);
+                out.push_back(received_datagram{src, std::move(buf)});
+                continue;
+            }
+
+            for (size_t off = 0; off < len; off += segment) {
+                out.push_back(received_datagram{src, buf.share(off, std::min(segment, len - off))});
+            }
+        }
+
+        return got;
+    }
+
+public:
+    explicit udp_socket_channel(const seastar::socket_address &local)
+            : _fd(open_socket(local)), _addr(local), _recv_pool(UDP_RECV_BUFFER_SIZE, UDP_RECV_POOL_BYTES) {
+        int segment_size = 0;
+        socklen_t len = sizeof(segment_size);
+        _gso = getsockopt(raw_fd(), SOL_UDP, UDP_SEGMENT, &segment_size, &len) == 0;
+
+        int on = 1;
+        _gro = setsockopt(raw_fd(), SOL_UDP, UDP_GRO, &on, sizeof(on)) == 0;
+    }
+
+    // In-flight operations point back here.
+    udp_socket_channel(const udp_socket_channel &) = delete;
+    udp_socket_channel &operator=(const udp_socket_channel &) = delete;
+
+    seastar::socket_address local_address() const override {
+        return _addr;
+    }
+
+    // Single datagrams, taken like receive_batch() does, so messages
+    // coalesced by GRO are split here too.
+    seastar::future<seastar::net::udp_datagram> receive() override {
+        if (_recv_next < _recv_pending.size()) {
+            received_datagram &dgram = _recv_pending[_recv_next++];
+            seastar::net::fragment frag{dgram.data.get_write(), dgram.data.size()};
+            seastar::net::packet data(frag, dgram.data.release());
+            return seastar::make_ready_future<seastar::net::udp_datagram>(seastar::net::udp_datagram(
+                    std::make_unique<socket_datagram>(dgram.src, _addr, std::move(data))));
+        }
+
+        _recv_pending.clear();
+        _recv_next = 0;
+        return receive_batch(1, _recv_pending).then([this] {
+            return receive();
+        });
+    }
+
+    // Waits for the socket to become readable and appends what one
+    // recvmmsg() of up to `max` messages returns to `out`; messages
+    // coalesced by GRO are split into their datagrams. The datagrams keep
+    // the order they arrived in.
+    seastar::future<> receive_batch(unsigned max, std::vector<received_datagram> &out) {
+        max = std::clamp(max, 1u, (unsigned) UDP_MAX_SEGMENTS);
+
+        if (receive_messages(max, out) >= 0) {
+            return seastar::make_ready_future<>();
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return _fd.readable().then([this, max, &out] {
+                return receive_batch(max, out);
+            });
+        }
+        if (errno == ENOMEM) {
+            return seastar::make_exception_future<>(std::bad_alloc());
+        }
+        return seastar::make_exception_future<>(std::system_error(errno, std::system_category(), "recvmmsg"));
+    }
+
+    seastar::future<> send(const seastar::socket_address &dst, const char *msg) override {
+        return send(dst, seastar::net::packet::from_static_data(msg, strlen(msg)));
+    }
+
+    seastar::future<> send(const seastar::socket_address &dst, seastar::net::packet p) override {
+        auto state = std::make_unique<send_state>();
+        state->dst = dst;
+        for (auto &frag : p.fragments()) {
+            state->iov.push_back(iovec{frag.base, frag.size});
+        }
+        state->keep = std::move(p);
+
+        memset(&state->msg, 0, sizeof(state->msg));
+        state->msg.msg_name = &state->dst.u.sa;
+        state->msg.msg_namelen = state->dst.length();
+        state->msg.msg_iov = state->iov.data();
+        state->msg.msg_iovlen = state->iov.size();
+
+        _send_syscalls++;
+        auto sent = _fd.sendmsg(&state->msg);
+        return sent.then([state = std::move(state)](size_t) {
+        });
+    }
+
+    // Sends `segs` to `dst` in as few syscalls as the kernel allows; all
+    // but the last segment must be of the same size.
+    seastar::future<> send_segments(const seastar::socket_address &dst,
+                                    std::vector<seastar::temporary_buffer<char>> segs) {
+        return seastar::do_with(std::move(segs), [this, dst](auto &segs) {
+            return send_bursts(dst, segs, 0);
+        });
+    }
+
+    void shutdown_input() override {
+        _fd.abort_reader();
+    }
+
+    void shutdown_output() override {
+        _fd.abort_writer();
+    }
+
+    bool is_closed() const override {
+        return _closed;
+    }
+
+    void close() override {
+        _closed = true;
+        _fd.close();
+    }
+
+    bool gso() const {
+        return _gso;
+    }
+
+    bool gro() const {
+        return _gro;
+    }
+
+    // sendmsg() and sendmmsg() calls made.
+    uint64_t send_syscalls() const {
+        return _send_syscalls;
+    }
+};
+
+// Opens a server socket on `local`; *impl is pointed at it so bursts can
+// be passed to it directly.
+static inline seastar::net::udp_channel make_udp_socket_channel(const seastar::socket_address &local,
+                                                                udp_socket_channel **impl) {
+    auto chan = std::make_unique<udp_socket_channel>(local);
+    *impl = chan.get();
+    return seastar::net::udp_channel(std::move(chan));
+}
+
+#endif //SEASTAR_QUICHE_UDP_SOCKET_H
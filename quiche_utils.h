@@ -6,155 +6,286 @@
 #define SEASTAR_QUICHE_UTILS_H
 
 #include "quiche.h"
+#include "quiche_timer_wheel.h"
+#include "quiche_log.h"
+#include "quiche_random.h"
+#include "quiche_slab_pool.h"
+#include "quiche_send_queue.h"
+#include "quiche_egress.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <vector>
 #include <map>
+#include <set>
 #include <iostream>
+#include <string>
+#include <errno.h>
 
 #define LOCAL_CONN_ID_LEN 16
 
+// Every connection ID minted by the server starts with the id of the shard
+// owning the connection (big endian), the remaining bytes are random.
+#define CID_SHARD_BYTES 2
+
+// Shards whose ids fit in CID_SHARD_BYTES.
+#define CID_MAX_SHARDS ((uint64_t) 1 << (8 * CID_SHARD_BYTES))
+
+static_assert(CID_SHARD_BYTES < sizeof(unsigned) && CID_SHARD_BYTES < LOCAL_CONN_ID_LEN,
+              "shard id must fit an unsigned and leave random bytes in the connection ID");
+
+#define CID_NO_SHARD ((unsigned) -1)
+
 #define MAX_DATAGRAM_SIZE 1350
 
-#define MAX_TOKEN_LEN \
-    sizeof("quiche") - 1 + \
-    sizeof(struct sockaddr_storage) + \
-    QUICHE_MAX_CONN_ID_LEN
+// Largest payload a UDP datagram can carry.
+#define MAX_UDP_PAYLOAD 65527
+
+// Data accepted from a stream that its send side had no room for yet,
+// written out as flow control opens up.
+struct stream_backlog {
+    std::vector<uint8_t> data;
+    // Memory outliving the stream (a cached response), sent in place of
+    // `data` without copying it.
+    const uint8_t *borrowed = NULL;
+    size_t borrowed_len = 0;
+    // Bytes already handed to quiche.
+    size_t off = 0;
+    // The stream ends once the backlog is written.
+    bool fin = false;
+    // Reading the stream stopped because the backlog was too long.
+    bool read_paused = false;
+
+    const uint8_t *begin() const {
+        return (borrowed != NULL ? borrowed : data.data()) + off;
+    }
 
+    size_t size() const {
+        return (borrowed != NULL ? borrowed_len : data.size()) - off;
+    }
+};
+
+// A connection with everything the server keeps about it. Owns the quiche
+// connection, which is freed together with the object.
 struct conn_io {
 
-    uint8_t cid[LOCAL_CONN_ID_LEN];
-    quiche_conn *conn;
-    struct sockaddr_storage peer_addr;
-    socklen_t peer_addr_len;
+    uint8_t cid[LOCAL_CONN_ID_LEN] = {};
+    quiche_conn *conn = NULL;
+    // Set on HTTP/3 connections once the handshake is done.
+    quiche_h3_conn *http3 = NULL;
+    struct sockaddr_storage peer_addr = {};
+    socklen_t peer_addr_len = 0;
+    struct sockaddr_storage local_addr = {};
+    socklen_t local_addr_len = 0;
+    // Next quiche timeout (loss recovery, idle), on the shard's timer wheel.
+    struct timer_wheel_entry timer = {};
+    // Place in the shard's queue of connections with packets to send.
+    struct send_queue_entry send_entry = {};
+    // Bytes of this connection handed out for sending.
+    seastar::lw_shared_ptr<egress_account> egress;
+    bool established = false;
+    // The handshake took the client's 0-RTT data.
+    bool early_data = false;
+    // Destination connection ID of the client's first Initial, for
+    // connections accepted without Retry; packets to it are routed here
+    // until the handshake completes.
+    uint8_t odcid[QUICHE_MAX_CONN_ID_LEN] = {};
+    size_t odcid_len = 0;
+    // Sequence number of the next stream the peer may open, per
+    // bidirectional (0) and unidirectional (1) streams.
+    uint64_t next_peer_stream[2] = {};
+    // Streams with unsent data, and the bytes pending on all of them.
+    std::map<uint64_t, stream_backlog> backlog;
+    size_t backlog_bytes = 0;
+    // HTTP/3 streams whose request body is being echoed.
+    std::set<uint64_t> http3_posts;
+
+    conn_io() = default;
+
+    // The timer entry is linked into the wheel by address.
+    conn_io(const conn_io &) = delete;
+    conn_io &operator=(const conn_io &) = delete;
+
+    ~conn_io() {
+        if (http3 != NULL) {
+            quiche_h3_conn_free(http3);
+        }
+        if (conn != NULL) {
+            quiche_conn_free(conn);
+        }
+    }
 };
 
 
-void setup_config(quiche_config **config) {
+// Transport parameters of the server. Filled from the command line before
+// the shards start and only read afterwards; every shard builds its own
+// quiche_config from it.
+struct transport_settings {
+    uint16_t port = 1234;
+    enum quiche_cc_algorithm cc = QUICHE_CC_RENO;
+    bool hystart = true;
+    bool pacing = true;
+    // Accept 0-RTT data from clients resuming a session. Session tickets
+    // are encrypted with keys of the shard's TLS context, so a ticket only
+    // resumes on the shard that issued it.
+    bool early_data = true;
+    uint64_t idle_timeout_ms = 5000;
+    size_t max_payload = MAX_DATAGRAM_SIZE;
+    uint64_t max_data = 10000000;
+    uint64_t max_stream_data = 1000000;
+    // Upper bounds for quiche's flow control window auto-tuning, 0 keeps
+    // quiche's defaults.
+    uint64_t max_connection_window = 0;
+    uint64_t max_stream_window = 0;
+    uint64_t max_streams_bidi = 100;
+    uint64_t max_streams_uni = 100;
+    uint64_t max_ack_delay_ms = 25;
+    // New connection attempts per second and shard from which clients are
+    // sent a Retry to prove their address; 0 always asks for one.
+    uint64_t retry_threshold = 0;
+    // Handshakes a shard keeps in progress at once; Initials beyond it are
+    // dropped.
+    uint64_t max_handshakes = 4096;
+    // Bytes of outgoing datagrams a shard and a single connection may have
+    // queued for the socket (including the pacer) before sending pauses.
+    size_t egress_limit = 64 << 20;
+    size_t conn_egress_limit = 1 << 20;
+    std::string cert = "./cert.crt";
+    std::string key = "./cert.key";
+};
+
+static inline bool parse_cc_algorithm(const std::string &name, enum quiche_cc_algorithm *cc) {
+    if (name == "reno") {
+        *cc = QUICHE_CC_RENO;
+    } else if (name == "cubic") {
+        *cc = QUICHE_CC_CUBIC;
+    } else if (name == "bbr") {
+        *cc = QUICHE_CC_BBR;
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+// Leaves *config NULL if the config can't be created or the certificate
+// can't be loaded.
+static void setup_config(quiche_config **config, const transport_settings &settings) {
     *config = quiche_config_new(QUICHE_PROTOCOL_VERSION);
     if (*config == NULL) {
-        fprintf(stderr, "failed to create config\n");
-        exit(1);
+        quic_log.error("failed to create config");
+        return;
     }
 
-    quiche_config_load_cert_chain_from_pem_file(*config, "./cert.crt");
-    quiche_config_load_priv_key_from_pem_file(*config, "./cert.key");
+    if (quiche_config_load_cert_chain_from_pem_file(*config, settings.cert.c_str()) < 0 ||
+        quiche_config_load_priv_key_from_pem_file(*config, settings.key.c_str()) < 0) {
+        quic_log.error("failed to load certificate {} / key {}", settings.cert, settings.key);
+        quiche_config_free(*config);
+        *config = NULL;
+        return;
+    }
 
     quiche_config_set_application_protos(*config,
                                          (uint8_t *) "\x0ahq-interop\x05hq-29\x05hq-28\x05hq-27\x08http/0.9", 38);
 
-    quiche_config_set_max_idle_timeout(*config, 5000);
-    quiche_config_set_max_recv_udp_payload_size(*config, MAX_DATAGRAM_SIZE);
-    quiche_config_set_max_send_udp_payload_size(*config, MAX_DATAGRAM_SIZE);
-    quiche_config_set_initial_max_data(*config, 10000000);
-    quiche_config_set_initial_max_stream_data_bidi_local(*config, 1000000);
-    quiche_config_set_initial_max_stream_data_bidi_remote(*config, 1000000);
-    quiche_config_set_initial_max_streams_bidi(*config, 100);
-    quiche_config_set_cc_algorithm(*config, QUICHE_CC_RENO);
-
-    if (*config == NULL) {
-        std::cout << "Failed to create quiche confiassag" << std::endl;
-
+    quiche_config_set_max_idle_timeout(*config, settings.idle_timeout_ms);
+    quiche_config_set_max_recv_udp_payload_size(*config, settings.max_payload);
+    quiche_config_set_max_send_udp_payload_size(*config, settings.max_payload);
+    quiche_config_set_initial_max_data(*config, settings.max_data);
+    quiche_config_set_initial_max_stream_data_bidi_local(*config, settings.max_stream_data);
+    quiche_config_set_initial_max_stream_data_bidi_remote(*config, settings.max_stream_data);
+    quiche_config_set_initial_max_stream_data_uni(*config, settings.max_stream_data);
+    quiche_config_set_initial_max_streams_bidi(*config, settings.max_streams_bidi);
+    quiche_config_set_initial_max_streams_uni(*config, settings.max_streams_uni);
+    quiche_config_set_max_ack_delay(*config, settings.max_ack_delay_ms);
+    if (settings.max_connection_window > 0) {
+        quiche_config_set_max_connection_window(*config, settings.max_connection_window);
+    }
+    if (settings.max_stream_window > 0) {
+        quiche_config_set_max_stream_window(*config, settings.max_stream_window);
+    }
+    quiche_config_set_cc_algorithm(*config, settings.cc);
+    quiche_config_enable_hystart(*config, settings.hystart);
+    quiche_config_enable_pacing(*config, settings.pacing);
+    if (settings.early_data) {
+        quiche_config_enable_early_data(*config);
     }
 }
 
-static void mint_token(const uint8_t *dcid, size_t dcid_len,
-                       struct sockaddr_storage *addr, socklen_t addr_len,
-                       uint8_t *token, size_t *token_len) {
-    memcpy(token, "quiche", sizeof("quiche") - 1);
-    memcpy(token + sizeof("quiche") - 1, addr, addr_len);
-    memcpy(token + sizeof("quiche") - 1 + addr_len, dcid, dcid_len);
-
-    *token_len = sizeof("quiche") - 1 + addr_len + dcid_len;
-}
-
-static bool validate_token(const uint8_t *token, size_t token_len,
-                           struct sockaddr_storage *addr, socklen_t addr_len,
-                           uint8_t *odcid, size_t *odcid_len) {
-    if ((token_len < sizeof("quiche") - 1) ||
-        memcmp(token, "quiche", sizeof("quiche") - 1)) {
-        return false;
+static inline void cid_set_shard(uint8_t *cid, unsigned shard) {
+    for (int i = CID_SHARD_BYTES - 1; i >= 0; i--) {
+        cid[i] = (uint8_t) shard;
+        shard >>= 8;
     }
+}
 
-    token += sizeof("quiche") - 1;
-    token_len -= sizeof("quiche") - 1;
-
-    if ((token_len < addr_len) || memcmp(token, addr, addr_len)) {
-        return false;
+// Returns the shard encoded in a locally minted connection ID, or
+// CID_NO_SHARD if the ID cannot have been minted by us.
+static inline unsigned cid_shard(const uint8_t *cid, size_t cid_len) {
+    if (cid_len != LOCAL_CONN_ID_LEN) {
+        return CID_NO_SHARD;
     }
 
-    token += addr_len;
-    token_len -= addr_len;
-
-    if (*odcid_len < token_len) {
-        return false;
+    unsigned shard = 0;
+    for (int i = 0; i < CID_SHARD_BYTES; i++) {
+        shard = (shard << 8) | cid[i];
     }
-
-    memcpy(odcid, token, token_len);
-    *odcid_len = token_len;
-
-    return true;
+    return shard;
 }
 
-static uint8_t *gen_cid(uint8_t *cid, size_t cid_len) {
-    int rng = open("/dev/urandom", O_RDONLY);
-    if (rng < 0) {
-        perror("failed to open /dev/urandom");
+static uint8_t *gen_cid(uint8_t *cid, size_t cid_len, unsigned shard) {
+    if (!shard_random.fill(cid, cid_len)) {
+        QLOG_LIMITED(quic_log, seastar::log_level::error, "failed to create connection ID: {}", strerror(errno));
         return NULL;
     }
 
-    ssize_t rand_len = read(rng, cid, cid_len);
-    if (rand_len < 0) {
-        perror("failed to create connection ID");
-        return NULL;
-    }
+    cid_set_shard(cid, shard);
 
     return cid;
 }
 
-static struct conn_io *create_conn(uint8_t *scid, size_t scid_len,
+// Accepts a connection into an object from `pool`; give it back with
+// pool.destroy(), which also frees the quiche connection.
+static struct conn_io *create_conn(slab_pool<conn_io> &pool,
+                                   uint8_t *scid, size_t scid_len,
                                    uint8_t *odcid, size_t odcid_len,
                                    struct sockaddr *local_addr,
                                    socklen_t local_addr_len,
                                    struct sockaddr_storage *peer_addr,
-                                   socklen_t peer_addr_len, struct quiche_config* config,
-                                   std::map<std::vector<uint8_t>, struct conn_io*> &clients)
+                                   socklen_t peer_addr_len, struct quiche_config* config)
 {
-    struct conn_io *conn_data = NULL;
-    conn_data = (conn_io*) calloc(1, sizeof(conn_io));
-    if (conn_data == NULL) {
-        fprintf(stderr, "failed to allocate connection IO\n");
-        return NULL;
-    }
-
     if (scid_len != LOCAL_CONN_ID_LEN) {
-        fprintf(stderr, "failed, scid length too short\n");
+        QLOG_LIMITED(quic_log, seastar::log_level::warn, "failed, scid length too short");
+        return NULL;
     }
 
-    memcpy(conn_data->cid, scid, LOCAL_CONN_ID_LEN);
-    quiche_conn *conn = quiche_accept(scid, scid_len,
-                                      odcid, odcid_len,
-                                      local_addr,
-                                      local_addr_len,
-                                      (struct sockaddr*) peer_addr,
-                                      peer_addr_len,
-                                      config);
-
-
-    if (conn == NULL) {
-        fprintf(stderr, "failed to create connection\n");
+    struct conn_io *conn_data = pool.make();
+    if (conn_data == NULL) {
+        QLOG_LIMITED(quic_log, seastar::log_level::error, "failed to allocate connection IO");
         return NULL;
     }
 
-    conn_data->conn = conn;
-
+    memcpy(conn_data->cid, scid, LOCAL_CONN_ID_LEN);
     memcpy(&conn_data->peer_addr, peer_addr, peer_addr_len);
     conn_data->peer_addr_len = peer_addr_len;
+    memcpy(&conn_data->local_addr, local_addr, local_addr_len);
+    conn_data->local_addr_len = local_addr_len;
+
+    conn_data->conn = quiche_accept(conn_data->cid, LOCAL_CONN_ID_LEN,
+                                    odcid, odcid_len,
+                                    (struct sockaddr*) &conn_data->local_addr,
+                                    conn_data->local_addr_len,
+                                    (struct sockaddr*) &conn_data->peer_addr,
+                                    conn_data->peer_addr_len,
+                                    config);
+
+    if (conn_data->conn == NULL) {
+        QLOG_LIMITED(quic_log, seastar::log_level::warn, "failed to create connection");
+        pool.destroy(conn_data);
+        return NULL;
+    }
 
-    std::vector<uint8_t> key(conn_data->cid, conn_data->cid + LOCAL_CONN_ID_LEN);
-    clients[key] = conn_data;
-    fprintf(stderr, "New connection has been created.\n");
+    QLOG_DEBUG(quic_log, "new connection on shard {}", cid_shard(conn_data->cid, LOCAL_CONN_ID_LEN));
 
     return conn_data;
 }